@@ -53,6 +53,14 @@
 #include "compress.h"
 #include "siglock.h"
 
+#ifdef HAVE_LIBLZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_LIBLZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+
 #ifndef __OPTIMIZE__
 #define __OPTIMIZE__
 #endif
@@ -93,8 +101,10 @@ using namespace std;
 //#define MAX_KMALLOC_SIZE 2L<<17
 
 #define CLOOP_PREAMBLE "#!/bin/sh\n" "#V2.0 Format\n" "modprobe cloop file=$0 && mount -r -t iso9660 /dev/cloop $1\n" "exit $?\n"
+#define CLOOP_PREAMBLE_V3 "#!/bin/sh\n" "#V3.0 Format\n" "modprobe cloop file=$0 && mount -r -t iso9660 /dev/cloop $1\n" "exit $?\n"
 
-#define MAXLEN(bs) ((bs) + (bs)/1000 + 12)
+// worst case expansion of all compressors (lz4 needs the most)
+#define MAXLEN(bs) ((bs) + (bs)/250 + 256)
 
 int maxlen(0);
 
@@ -146,8 +156,32 @@ unsigned long blocksize=0;
 unsigned long expected_blocks=0;
 //unsigned long numblocks=0;
 int method=Z_BEST_COMPRESSION;
-const int maxalg=11;
+int compressor=CLOOP_COMPRESSOR_ZLIB;
+int store_threshold=0; // percent, blocks saving less are stored uncompressed
+bool dedup(false); // share the data of duplicate blocks, don't store zero blocks
+bool compact_index(false); // -I, grouped index with short lengths
+bool block_hashes(false); // -H, content hash of each block for the shared cache
+#define INDEX_GROUP 64 // blocks per compact index group
+// CLOOP_COMPRESSOR_ZSTD is reserved, the cloop driver can't read it
+const char *compressor_names[CLOOP_COMPRESSOR_MAX] = { "zlib", "xz", "lz4", NULL, "none" };
+const int compressor_maxlevel[CLOOP_COMPRESSOR_MAX] = { 9, 9, 12, 0, 0 };
+#define MAX_LEVEL 12 // of all compressors
+
+// Methods raced by -b after the zlib levels (0..9) and 7zip (10). Their
+// winners are recorded in the codec map, so the reader knows how to decode.
+struct extra_method { int compressor; int level; };
+const extra_method extra_methods[] = {
+    { CLOOP_COMPRESSOR_NONE, 0 },
+    { CLOOP_COMPRESSOR_LZ4,  0 }, { CLOOP_COMPRESSOR_LZ4,  9 }, { CLOOP_COMPRESSOR_LZ4, 12 }
+};
+#define ZLIBALG 11
+const int maxalg=ZLIBALG+sizeof(extra_methods)/sizeof(extra_methods[0]);
 unsigned int levelcount[maxalg];
+
+// the compressor of a block compressed with method number best
+inline int best_compressor(int best) {
+    return best<ZLIBALG ? CLOOP_COMPRESSOR_ZLIB : extra_methods[best-ZLIBALG].compressor;
+}
 bool be_verbose(false), be_quiet(false);
 
 #define TOFILE 0
@@ -162,8 +196,33 @@ int workThreads=3;
 vector<char *> hostpool;
 
 vector<uint64_t> lengths;
+vector<uint8_t> codecs; // per block, for the codec map of -b images
+vector<uint8_t> digests; // -H: CLOOP_HASH_SIZE bytes per block
+
+// -d: blocks of the base image by their hash, its UUID, and for each block
+// of the delta image the base block + 1 (network order), 0 if stored here
+const char *basefile(NULL);
+map<string, uint32_t> base_index;
+unsigned char base_uuid[16];
+vector<uint32_t> base_refs;
+unsigned int base_blocks=0;
+
+// -n, -z: the data goes to segment files OUTFILE.1, OUTFILE.2, ..., the
+// index has the segment in the top bits of the offsets, see cloop.h
+unsigned int segments=0; // striped over that many, 0: no segment files
+uint64_t segment_limit=0; // largest size of a segment file, 0: no limit
+vector<FILE *> segment_fh; // segment n is [n-1]
+vector<uint64_t> segment_size;
+vector<uint64_t> segment_pos; // of each block, or compact index group
 vector<char *> blocks;
 
+// -D: position of each block's data relative to the first one, and the
+// first block with each content hash
+vector<uint64_t> extents;
+multimap<uint64_t, int> hashes;
+off_t data_base=-1; // position of the data in datafh, -1 if not seekable
+unsigned int zero_blocks=0, shared_blocks=0;
+
 pthread_mutex_t mainlock = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t maincond = PTHREAD_COND_INITIALIZER;
 #define lock pthread_mutex_lock( &mainlock )
@@ -187,18 +246,130 @@ int in(-1);
 int start_server(int port);
 int setup_connection(char *peer);
 
-/* cludge
-FILE * split_fopen( char *path, char *mode);
-int split_fwrite(void *ptr, size_t nmemb);
-uint64_t chunk_size=0;
-*/
+/*
+ * Compress one block with any compressor, outLen is the size of out on entry
+ * and the compressed size on return.
+ */
+bool compress_block(int compressor, int level, char *out, unsigned long &outLen,
+        const char *in, unsigned long inLen)
+{
+    switch(compressor) {
+        case CLOOP_COMPRESSOR_ZLIB:
+            return Z_OK == compress2((Bytef*) out, (uLongf*) &outLen, (const Bytef*) in, inLen, level);
+        case CLOOP_COMPRESSOR_NONE:
+            if(outLen<inLen)
+                return false;
+            memcpy(out, in, inLen);
+            outLen=inLen;
+            return true;
+#ifdef HAVE_LIBLZMA
+        case CLOOP_COMPRESSOR_XZ:
+            {
+                size_t pos=0;
+                // the kernel only verifies CRC32 checks
+                if(LZMA_OK != lzma_easy_buffer_encode(level, LZMA_CHECK_CRC32, NULL,
+                            (const uint8_t*) in, inLen, (uint8_t*) out, &pos, outLen))
+                    return false;
+                outLen=pos;
+                return true;
+            }
+#endif
+#ifdef HAVE_LIBLZ4
+        case CLOOP_COMPRESSOR_LZ4:
+            {
+                // level 0 is the fast compressor, all others use LZ4HC
+                int len = level ? LZ4_compress_HC(in, out, inLen, outLen, level)
+                    : LZ4_compress_default(in, out, inLen, outLen);
+                if(len<=0)
+                    return false;
+                outLen=len;
+                return true;
+            }
+#endif
+    }
+    return false;
+}
+
+/*
+ * Was advfs built with support for this compressor?
+ */
+bool compressor_supported(int compressor)
+{
+    switch(compressor) {
+        case CLOOP_COMPRESSOR_ZLIB:
+        case CLOOP_COMPRESSOR_NONE:
+#ifdef HAVE_LIBLZMA
+        case CLOOP_COMPRESSOR_XZ:
+#endif
+#ifdef HAVE_LIBLZ4
+        case CLOOP_COMPRESSOR_LZ4:
+#endif
+            return true;
+    }
+    return false;
+}
+
+/*
+ * SHA-256 of len bytes at data (FIPS 180-4), for the block hashes of -H
+ */
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+void sha256(const unsigned char *data, uint64_t len, unsigned char digest[32])
+{
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+    uint32_t h[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                      0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    unsigned char tail[128];
+    uint64_t full = len & ~63ULL, tail_len = (len & 63) < 56 ? 64 : 128;
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, data + full, len - full);
+    tail[len - full] = 0x80;
+    for(int i=0; i<8; i++)
+        tail[tail_len - 1 - i] = (len << 3) >> (8 * i);
+    for(uint64_t pos=0; pos < full + tail_len; pos+=64) {
+        const unsigned char *p = pos < full ? data + pos : tail + (pos - full);
+        uint32_t w[64], a[8];
+        for(int i=0; i<16; i++)
+            w[i] = (uint32_t) p[4*i] << 24 | p[4*i+1] << 16 | p[4*i+2] << 8 | p[4*i+3];
+        for(int i=16; i<64; i++)
+            w[i] = w[i-16] + (ROR32(w[i-15], 7) ^ ROR32(w[i-15], 18) ^ (w[i-15] >> 3))
+                 + w[i-7] + (ROR32(w[i-2], 17) ^ ROR32(w[i-2], 19) ^ (w[i-2] >> 10));
+        memcpy(a, h, sizeof(a));
+        for(int i=0; i<64; i++) {
+            uint32_t t1 = a[7] + (ROR32(a[4], 6) ^ ROR32(a[4], 11) ^ ROR32(a[4], 25))
+                        + ((a[4] & a[5]) ^ (~a[4] & a[6])) + k[i] + w[i];
+            uint32_t t2 = (ROR32(a[0], 2) ^ ROR32(a[0], 13) ^ ROR32(a[0], 22))
+                        + ((a[0] & a[1]) ^ (a[0] & a[2]) ^ (a[1] & a[2]));
+            memmove(a + 1, a, 7 * sizeof(uint32_t));
+            a[4] += t1;
+            a[0] = t1 + t2;
+        }
+        for(int i=0; i<8; i++)
+            h[i] += a[i];
+    }
+    for(int i=0; i<32; i++)
+        digest[i] = h[i/4] >> (24 - 8 * (i%4));
+}
 
 class compressItem {
     public:
 
         // those are the only interesting unique attributes
         int best;
+        int codec; // CLOOP_COMPRESSOR_* of outBuf
         unsigned long compLen;
+        uint64_t hash; // of inBuf, for -D
+        uint32_t base; // 1 + the same block in the base image of -d, 0 if none
+        unsigned char digest[CLOOP_HASH_SIZE]; // of inBuf, for -H
+        bool zero; // inBuf is all zeroes, nothing to store
 #define STOPMARK -2
 #define SDIRTY -1
 #define SFRESH 0
@@ -239,6 +410,7 @@ class compressItem {
             
             compLen=ntohl(rhead[0]);
             best=ntohl(rhead[1]);
+            codec=best_compressor(best);
             DEBUG("Receiving: " << compLen << " bytes\n");
             // Cygwin does not know MSG_WAITALL and splits large blobs :(
             char * ptr = outBuf;
@@ -254,13 +426,24 @@ class compressItem {
         }
 
         bool doLocalCompression(int method=0) {
-            const int maxalg=11;
             int z_error;
 
-            if(method >= 0)
+            if(method >= 0 && compressor != CLOOP_COMPRESSOR_ZLIB)
+            {
+                compLen=maxlen;
+                best=0; // levelcount only tracks the zlib methods
+                codec=compressor;
+                if(!compress_block(compressor, method, outBuf, compLen, inBuf, blocksize))
+                {
+                    cerr << "**** Error compressing block with " << compressor_names[compressor] << endl;
+                    return false;
+                }
+            }
+            else if(method >= 0)
             {
                 compLen=maxlen;
                 best=method;
+                codec=CLOOP_COMPRESSOR_ZLIB;
                 z_error=compress2((Bytef*) outBuf, (uLongf*) & compLen, (Bytef*)inBuf, blocksize, method);
                 if(z_error != Z_OK)
                 {
@@ -271,6 +454,7 @@ class compressItem {
             else if(method==-1) {
                 compLen=maxlen;
                 best=10;
+                codec=CLOOP_COMPRESSOR_ZLIB;
                 unsigned int tmp=compLen; // stupid, but needed on 64bit...
                 if(!compress_zlib(shrink_extreme, (unsigned char *) outBuf, tmp, (unsigned char *)inBuf, blocksize))
                 {
@@ -303,7 +487,17 @@ class compressItem {
                             return false;
                         }
                     }
-                    else { // try 7zip as the last one
+                    else if(j>=ZLIBALG) { // other compressors, if built in
+                        const extra_method &m = extra_methods[j-ZLIBALG];
+                        if(!compressor_supported(m.compressor))
+                            continue;
+                        if(!compress_block(m.compressor, m.level, tmpBuf, tmpLen, inBuf, blocksize))
+                        {
+                            fprintf(stderr, "*** Error compressing block with %s!\n", compressor_names[m.compressor]);
+                            return false;
+                        }
+                    }
+                    else { // try 7zip after the zlib levels
 
                         unsigned int tmp=tmpLen; // stupid, but needed on 64bit...
                         if(!compress_zlib(shrink_extreme, (unsigned char *) tmpBuf, tmp, (unsigned char *)inBuf, blocksize))
@@ -323,11 +517,64 @@ class compressItem {
                     }
                 }
                 free(tmpBuf);
+                codec=best_compressor(best);
             }
 
             DEBUG("done");
             return true;
         }
+
+        // FNV-1a hash of the input, only used to find duplicate candidates.
+        // All zero blocks are not compressed at all, returns true for them.
+        bool hashBlock() {
+            uint64_t h=14695981039346656037ULL, word, any=0;
+            for(unsigned long i=0; i<blocksize; i+=sizeof(word)) {
+                memcpy(&word, inBuf+i, sizeof(word));
+                h=(h^word)*1099511628211ULL;
+                any|=word;
+            }
+            hash=h;
+            zero=!any;
+            if(zero) {
+                compLen=0;
+                codec=compressor;
+                best=0;
+            }
+            return zero;
+        }
+
+        // The start of the SHA-256 of the input, written to the index by -H
+        void digestBlock() {
+            unsigned char full[32];
+            sha256((const unsigned char *) inBuf, blocksize, full);
+            memcpy(digest, full, CLOOP_HASH_SIZE);
+        }
+
+        // The base image of -d has the block, nothing to store then.
+        // Returns true for such blocks, digestBlock() must be called first.
+        bool findBase() {
+            map<string, uint32_t>::iterator it=base_index.find(string((char *) digest, CLOOP_HASH_SIZE));
+            if(it==base_index.end())
+                return false;
+            base=it->second+1;
+            compLen=0;
+            codec=compressor;
+            best=0;
+            return true;
+        }
+
+        // Keep the block uncompressed if compression saves less than
+        // store_threshold percent, it is then read without decompression.
+        void storeIfIncompressible() {
+            if(!store_threshold || codec==CLOOP_COMPRESSOR_NONE)
+                return;
+            if(compLen*100 <= blocksize*(100-store_threshold))
+                return;
+            memcpy(outBuf, inBuf, blocksize);
+            compLen=blocksize;
+            codec=CLOOP_COMPRESSOR_NONE;
+            best=ZLIBALG; // extra_methods[0]
+        }
 };
 
 
@@ -385,6 +632,14 @@ get_fresh_stuff:
         unlock;
 #endif
 
+        pool[pos].zero=false;
+        pool[pos].base=0;
+        if(block_hashes || basefile)
+            pool[pos].digestBlock();
+        if(basefile && pool[pos].findBase())
+            goto submit;
+        if(dedup && pool[pos].hashBlock())
+            goto submit;
 do_local:
         if(con<0) {
             DEBUG("c5");
@@ -400,6 +655,8 @@ do_local:
                 goto do_local;
             }
         }
+        pool[pos].storeIfIncompressible();
+submit:
         DEBUG("Calc: submitting results of pos: " << pos);
         DEBUG("c7");
         lock;
@@ -411,12 +668,39 @@ do_local:
     return(NULL); // g++ shut up
 }
 
+// Compare len bytes of compressed data with the stored data of block k
+bool sameData(int k, const char *buf, unsigned long len) {
+    if(targetkind==TOMEM)
+        return !memcmp(blocks[k], buf, len);
+    if(data_base<0)
+        return false; // can't read back, don't share
+    vector<char> stored(len);
+    fflush(datafh);
+    if(pread(fileno(datafh), &stored[0], len, data_base+extents[k]) != (ssize_t) len)
+        return false;
+    return !memcmp(&stored[0], buf, len);
+}
+
+// Earlier block with the same data as item, or -1. Identical compressed
+// data means identical content, so hash collisions do no harm.
+int findShared(compressItem &item) {
+    typedef multimap<uint64_t, int>::iterator hit;
+    pair<hit, hit> range=hashes.equal_range(item.hash);
+    for(hit it=range.first; it!=range.second; ++it) {
+        int k=it->second;
+        if(lengths[k]==item.compLen && codecs[k]==item.codec &&
+                sameData(k, item.outBuf, item.compLen))
+            return k;
+    }
+    return -1;
+}
+
 void *outputFetch(void *ptr) {
 
     //int id = * ( (int*) ptr);
 
     DEBUG("Fetcher thread created");
-    uint64_t total_compressed(0);
+    uint64_t total_compressed(0), data_written(0);
     for(int i=0; i<maxalg; i++) levelcount[i]=0; // or better with memset?
     time_t starttime=time(NULL);
     DEBUG("f1");
@@ -439,13 +723,44 @@ void *outputFetch(void *ptr) {
         unlock;
         DEBUG("f5");
 
-        total_compressed += pool[pos].compLen;
-
-        ++levelcount[pool[pos].best];
+        // a compact index can't point back, only zero blocks are dropped then
+        bool unchanged = pool[pos].base>0; // in the base image of -d
+        int shared = (dedup && !compact_index && !pool[pos].zero && !unchanged) ? findShared(pool[pos]) : -1;
+        bool store = !pool[pos].zero && !unchanged && shared<0;
+
+        if(store)
+            total_compressed += pool[pos].compLen;
+
+        if(!pool[pos].zero && !unchanged)
+            ++levelcount[pool[pos].best];
+
+        if(dedup) {
+            if(pool[pos].zero)
+                zero_blocks++;
+            else if(shared>=0)
+                shared_blocks++;
+            else if(!unchanged)
+                hashes.insert(make_pair(pool[pos].hash, (int) lengths.size()));
+            extents.push_back(shared>=0 ? extents[shared] : data_written);
+        }
+        if(store)
+            data_written += pool[pos].compLen;
 
         lengths.push_back(pool[pos].compLen); // could seek, but that may be faster after all
+        codecs.push_back(pool[pos].codec);
+        if(block_hashes)
+            digests.insert(digests.end(), pool[pos].digest, pool[pos].digest+CLOOP_HASH_SIZE);
+        if(basefile) {
+            base_refs.push_back(htonl(pool[pos].base));
+            if(unchanged)
+                base_blocks++;
+        }
         DEBUG("f6, target: " << targetkind);
-        if(targetkind<TOMEM) 
+        if(!store) {
+            if(targetkind==TOMEM)
+                blocks.push_back(NULL);
+        }
+        else if(targetkind<TOMEM) 
         {
            DEBUG("f6.5");
            if(pool[pos].compLen != fwrite(pool[pos].outBuf, sizeof(char), pool[pos].compLen, datafh))
@@ -610,28 +925,208 @@ try_another_connection:
     
     if(!be_quiet) {
         fprintf(stderr,"\nStatistics:\n");
-        for(int j=0; j<maxalg-1; j++) 
-            fprintf(stderr,"gzip(%d): %5d (%5.2g%%)\n", 
-                    j,
+        if(compressor != CLOOP_COMPRESSOR_ZLIB)
+            fprintf(stderr,"%s(%d): %5d (%5.2g%%)\n",
+                    compressor_names[compressor], method,
+                    levelcount[0],
+                    100.0F*(float)levelcount[0]/(float)lengths.size());
+        else {
+            for(int j=0; j<10; j++) 
+                fprintf(stderr,"gzip(%d): %5d (%5.2g%%)\n", 
+                        j,
+                        levelcount[j],
+                        100.0F*(float)levelcount[j]/(float)lengths.size());
+            fprintf(stderr,"7zip: %5d (%5.2g%%)\n", 
+                    levelcount[10],
+                    100.0F*(float)levelcount[10]/(float)lengths.size());
+        }
+        for(int j=ZLIBALG; j<maxalg && (method==-2 || (j==ZLIBALG && store_threshold)); j++)
+            fprintf(stderr,"%s(%d): %5d (%5.2g%%)\n",
+                    compressor_names[extra_methods[j-ZLIBALG].compressor],
+                    extra_methods[j-ZLIBALG].level,
                     levelcount[j],
                     100.0F*(float)levelcount[j]/(float)lengths.size());
-        fprintf(stderr,"7zip: %5d (%5.2g%%)\n", 
-                levelcount[10],
-                100.0F*(float)levelcount[10]/(float)lengths.size());
+        if(dedup)
+            fprintf(stderr,"zero: %5d (%5.2g%%)\nshared: %5d (%5.2g%%)\n",
+                    zero_blocks,
+                    100.0F*(float)zero_blocks/(float)lengths.size(),
+                    shared_blocks,
+                    100.0F*(float)shared_blocks/(float)lengths.size());
+        if(basefile)
+            fprintf(stderr,"base: %5d (%5.2g%%)\n",
+                    base_blocks,
+                    100.0F*(float)base_blocks/(float)lengths.size());
     }
 
     return ret;
 };
 
-#define OPTIONS "bB:mrp:lt:hs:f:j:a:vqS:L:"
+// Read the block hashes and the UUID of the base image for -d
+void read_base(const char *path) {
+    struct cloop_head head;
+    struct cloop_head_v3 head_v3;
+    unsigned char hash[CLOOP_HASH_SIZE], none[CLOOP_HASH_SIZE];
+    FILE *f=fopen(path, "r");
+    if(!f)
+        die("Opening base image " << path);
+    if(1!=fread(&head, sizeof(head), 1, f) || head.preamble[0x0B]!='V' ||
+            head.preamble[0x0C]!='3' || 1!=fread(&head_v3, sizeof(head_v3), 1, f))
+        die("The base image is not a V3 image");
+    memset(none, 0, sizeof(none));
+    if(!(head_v3.flags & CLOOP_FLAG_BLOCK_HASHES) || !memcmp(head_v3.uuid, none, sizeof(none)))
+        die("The base image has no block hashes or no UUID, create it with -H");
+    if(blocksize && blocksize!=ntohl(head.block_size))
+        die("The base image has a block size of " << ntohl(head.block_size));
+    blocksize=ntohl(head.block_size);
+    uint64_t n=ntohl(head.num_blocks), skip;
+    if(head_v3.flags & CLOOP_FLAG_COMPACT_INDEX) {
+        uint64_t group=ntohs(head_v3.index_group);
+        skip=(n+group-1)/group * (8+group*head_v3.index_length_size);
+    }
+    else if(head_v3.flags & CLOOP_FLAG_EXTENTS)
+        skip=sizeof(struct cloop_extent)*n;
+    else
+        skip=sizeof(uint64_t)*(n+1);
+    if(head_v3.flags & CLOOP_FLAG_CODEC_MAP)
+        skip+=n;
+    if(fseeko(f, skip, SEEK_CUR)<0)
+        die("Seeking to the block hashes of the base image");
+    for(uint32_t i=0; i<n; i++) {
+        if(1!=fread(hash, sizeof(hash), 1, f))
+            die("Reading the block hashes of the base image");
+        if(memcmp(hash, none, sizeof(none))) // the first of equal blocks is taken
+            base_index.insert(make_pair(string((char *) hash, sizeof(hash)), i));
+    }
+    memcpy(base_uuid, head_v3.uuid, sizeof(base_uuid));
+    fclose(f);
+}
+
+// Random UUID (version 4) of a V3 image, delta images name their base by it
+void make_uuid(unsigned char uuid[16]) {
+    FILE *f=fopen("/dev/urandom", "r");
+    if(!f || 1!=fread(uuid, 16, 1, f))
+        die("Reading /dev/urandom");
+    fclose(f);
+    uuid[6]=(uuid[6]&0x0f)|0x40;
+    uuid[8]=(uuid[8]&0x3f)|0x80;
+}
+
+// Start the next segment file, OUTFILE.N, returns its number
+unsigned int open_segment(const char *tofile, const unsigned char *uuid) {
+    struct cloop_segment_head head;
+    unsigned int n=segment_fh.size()+1;
+    if(n>CLOOP_MAX_SEGMENTS)
+        die("More than " << CLOOP_MAX_SEGMENTS << " segment files needed, raise -z");
+    char suffix[8];
+    snprintf(suffix, sizeof(suffix), ".%u", n);
+    string name=string(tofile)+suffix;
+    FILE *f=fopen(name.c_str(), "w");
+    if(!f)
+        die("Opening segment file " << name);
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, CLOOP_SEGMENT_MAGIC, sizeof(CLOOP_SEGMENT_MAGIC));
+    memcpy(head.uuid, uuid, sizeof(head.uuid));
+    head.number=htonl(n);
+    if(1!=fwrite(&head, sizeof(head), 1, f))
+        die("Writing segment file " << name);
+    segment_fh.push_back(f);
+    segment_size.push_back(sizeof(head));
+    return n;
+}
+
+// Append len bytes to the segment file of the next stripe, returns their
+// offset with the segment in the top bits. A segment that would grow
+// beyond -z is followed by a new one for its stripe.
+uint64_t write_segment(const char *buf, uint64_t len, const char *tofile, const unsigned char *uuid) {
+    static vector<unsigned int> stripes; // segment of each, 0 before the first
+    static unsigned int stripe=0;
+    if(stripes.empty())
+        stripes.assign(segments, 0);
+    if(segment_limit && sizeof(struct cloop_segment_head)+len > segment_limit)
+        die("The segment size of -z is too small for " << len << " bytes of data");
+    unsigned int &n=stripes[stripe];
+    stripe=(stripe+1)%segments;
+    if(!n || (segment_limit && segment_size[n-1]+len > segment_limit))
+        n=open_segment(tofile, uuid);
+    uint64_t pos=segment_size[n-1] | (uint64_t) n<<CLOOP_SEGMENT_SHIFT;
+    if(len!=fwrite(buf, 1, len, segment_fh[n-1]))
+        die("Writing segment file " << n);
+    segment_size[n-1]+=len;
+    return pos;
+}
+
+// Move the compressed data to the segment files, block by block, or a
+// group of the compact index at a time, whose blocks must stay together.
+// Fills segment_pos, shared blocks of -D keep sharing their data.
+void write_segments(const char *tofile, const unsigned char *uuid) {
+    map<uint64_t, uint64_t> moved; // data position -> segment offset
+    vector<char> buf;
+    uint64_t rel=0; // position of the data as written by outputFetch
+    size_t step = compact_index ? INDEX_GROUP : 1;
+    fflush(datafh);
+    for(size_t i=0;i<lengths.size();i+=step) {
+        size_t n=min(lengths.size()-i, step);
+        uint64_t len=0;
+        for(size_t k=0;k<n;k++)
+            len+=lengths[i+k];
+        uint64_t from = compact_index ? rel : extents[i];
+        rel+=len;
+        if(!len) { // zero blocks or blocks of the base image, nothing to read
+            segment_pos.push_back(0);
+            continue;
+        }
+        map<uint64_t, uint64_t>::iterator it=moved.find(from);
+        if(it!=moved.end()) {
+            segment_pos.push_back(it->second);
+            continue;
+        }
+        buf.resize(len);
+        if(targetkind==TOMEM) {
+            uint64_t done=0;
+            for(size_t k=0;k<n;k++)
+                if(blocks[i+k]) {
+                    memcpy(&buf[done], blocks[i+k], lengths[i+k]);
+                    done+=lengths[i+k];
+                }
+        }
+        else if(pread(fileno(datafh), &buf[0], len, data_base+from) != (ssize_t) len)
+            die("Reading back the compressed data");
+        moved[from]=write_segment(&buf[0], len, tofile, uuid);
+        segment_pos.push_back(moved[from]);
+    }
+    for(size_t i=0;i<segment_fh.size();i++)
+        if(fclose(segment_fh[i]))
+            die("Writing segment file " << i+1);
+}
+
+// size of the index of n blocks, length_size is only used by -I
+uint64_t index_size(uint64_t n, int length_size) {
+    if(compact_index)
+        return (n+INDEX_GROUP-1)/INDEX_GROUP * (8+INDEX_GROUP*length_size);
+    if(dedup)
+        return sizeof(struct cloop_extent) * n;
+    return sizeof(uint64_t) * (n+1);
+}
+
+#define OPTIONS "bB:c:d:DHImn:rp:lt:hs:f:j:a:vqS:L:T:z:"
         
 int usage(char *progname)
 {
     cout << "Usage: advfs [options] INFILE OUTFILE [HOSTS...]" << endl;
     cout << "Options:" << endl;
-    cout << "  -b     Try all and choose the best compression method, see -L" << endl;
+    cout << "  -b     Try all and choose the best compression method per block, see -L" << endl;
     cout << "  -B N   Set the block size to N" << endl;
+    cout << "  -c C   Compressor C: zlib (default), xz, lz4 or none; see -L" << endl;
+    cout << "  -d B   Write a delta image that takes unchanged blocks from the image B,\n"
+            "         which must have been created with -H" << endl;
+    cout << "  -D     Store duplicate blocks only once and zero blocks not at all" << endl;
+    cout << "  -H     Store a content hash of each block, so the cloop driver can share\n"
+            "         the blocks that images have in common (module option shared_cache)" << endl;
+    cout << "  -I     Write a compact index, about 4 times smaller (with -D only zero\n"
+            "         blocks are dropped)" << endl;
     cout << "  -m     Use memory for temporary data storage (NOT recommended)" << endl;
+    cout << "  -n N   Stripe the data over N segment files OUTFILE.1... (implies -D\n"
+            "         unless -I is given), attach them with cloop_segments" << endl;
     cout << "  -r     Reuse output file as temporary file (NOT recommended)"   << endl;
     cout << "  -p M   Set a default value for port number to M" <<endl;
     cout << "  -l     Listening mode (as remote node)" <<endl;
@@ -642,11 +1137,14 @@ int usage(char *progname)
     cout << "  -v     Verbose mode, print extra statistics" <<endl;
     cout << "  -h     Help of the program" << endl;
     cout << "  -S X   Experimental option: store volume header in file X, see manpage" <<endl;
+    cout << "  -T P   Store blocks uncompressed if compression saves less than P percent" <<endl;
+    cout << "  -z Z   Start a new segment file before one gets larger than Z, see -n" <<endl;
     cout << "Performance tuning options:"<<endl;
     //cout << "  -j W   Jobsize, number W of blocks passed to each working thread per call"<<endl;
     cout << "  -a U   Job pool size (default: threadcount+3)" <<endl;
     cout << "  -L V   Compression level (-2..9); 9: zlib's best (default setting), 0: none,\n"
-            "         -1: 7zip, -2: do all and keep the best one" <<endl;
+            "         -1: 7zip, -2: do all and keep the best one (also stored and lz4)" <<endl;
+    cout << "         Other compressors: xz 0..9, lz4 0..12 (0: fast, else HC)" <<endl;
     /*
      * does not make sense, 7zip is about 10 times slower than all gzip methods together
      * , -3: like -2 but trying\n"
@@ -737,6 +1235,41 @@ int main(int argc, char **argv)
                 }
                 break;
 
+            case 'c':
+                for(compressor=0; compressor<CLOOP_COMPRESSOR_MAX; compressor++)
+                    if(compressor_names[compressor] && !strcmp(optarg, compressor_names[compressor]))
+                        break;
+                if(compressor==CLOOP_COMPRESSOR_MAX)
+                    die("Unknown compressor " << optarg);
+                if(!compressor_supported(compressor))
+                    die("This advfs was built without " << optarg << " support");
+                break;
+
+            case 'd':
+                basefile=optarg;
+                break;
+
+            case 'D':
+                dedup=true;
+                break;
+
+            case 'H':
+                block_hashes=true;
+                break;
+
+            case 'I':
+                compact_index=true;
+                break;
+
+            case 'n':
+                segments=getsize(optarg);
+                if(!segments) die("Invalid number of segments");
+                break;
+
+            case 'z':
+                segment_limit=getsize(optarg);
+                break;
+
             case 'm':
                 targetkind=TOMEM;
                 break;
@@ -747,10 +1280,16 @@ int main(int argc, char **argv)
 
             case 'L':
                 method=getsize(optarg);
-                if(method<-2 || method > 9)
+                if(method<-2 || method > MAX_LEVEL)
                     die("Invalid compression method");
                 break;
 
+            case 'T':
+                store_threshold=getsize(optarg);
+                if(store_threshold<0 || store_threshold>100)
+                    die("Invalid threshold, must be 0..100 percent");
+                break;
+
             case 'f':
                 targetkind=TOTEMPFILE;
                 tempfile=optarg;
@@ -836,12 +1375,40 @@ int main(int argc, char **argv)
     }
 
     // initializing and normalizing parameters
+    if(basefile)
+        read_base(basefile); // sets the block size
     if(!blocksize)  blocksize=65536;
     if(!poolsize) poolsize=workThreads+3;
     if(tempfile && targetkind==TOMEM) die("Either -r or -m is allowed");
     if(reuse_as_tempfile && tempfile) die("outfile reuse with another tempfile does not make sense");
     if(sepheader && (reuse_as_tempfile || targetkind!=TOFILE ))
         die("Separate header file only with pure file output supported"); // writing twice? Later... or never
+    if(segments || segment_limit) {
+        if(!segments)
+            segments=1;
+        if(!compact_index)
+            dedup=true; // the offsets in the index must not depend on each other
+        if(!strcmp(tofile, "-") || sepheader || reuse_as_tempfile)
+            die("Segment files need a named output file, without -S or -r");
+    }
+    if(compressor==CLOOP_COMPRESSOR_NONE && method>0)
+        method=0; // only one way to store
+    if(compressor==CLOOP_COMPRESSOR_ZLIB ? method>9 : (method<0 || method>compressor_maxlevel[compressor]))
+        die("Invalid compression level " << method << " for " << compressor_names[compressor]);
+    if(compressor!=CLOOP_COMPRESSOR_ZLIB && hostpool.size())
+        die("Remote compression nodes only support zlib");
+
+    // V2 header for zlib images, readable by all cloop versions. Images
+    // made with -b or -T mix compressors and carry a codec map after the index.
+    // With -D, the index has an offset and a length for each block, with -I
+    // a base offset and short lengths for each group of blocks. -H adds
+    // the block hashes after the codec map, -d the base map after them.
+    // With -n or -z, the image only keeps the header and the maps.
+    bool codec_map = (method==-2 || store_threshold);
+    size_t headsize = sizeof(head);
+    if(compressor!=CLOOP_COMPRESSOR_ZLIB || codec_map || dedup || compact_index || block_hashes ||
+            basefile || segments)
+        headsize += sizeof(struct cloop_head_v3);
 
     if(!tofile)
         die("Unknown output file. Provide a path name or - for STDOUT");
@@ -900,7 +1467,11 @@ int main(int argc, char **argv)
 
     // precalculate some values
     // expected values including additional pointer to store the initial offset
-    bytes_so_far = sizeof(head) + sizeof(uint64_t) * (expected_blocks+1);
+    // the compact index lengths are not known yet, reserve 32 bits for them
+    bytes_so_far = headsize + index_size(expected_blocks, 4)
+        + (codec_map ? expected_blocks : 0)
+        + (block_hashes ? expected_blocks*CLOOP_HASH_SIZE : 0)
+        + (basefile ? expected_blocks*sizeof(uint32_t) : 0);
     if(!be_quiet) 
         cerr << "Block size "<< blocksize << ", expected number of blocks: " << expected_blocks <<endl;
 
@@ -910,6 +1481,8 @@ int main(int argc, char **argv)
         datafh=targetfh;
     else if(targetkind==TOFILE && !reuse_as_tempfile) 
         fseeko(targetfh, bytes_so_far, SEEK_SET);
+    if(dedup || segments)
+        data_base=ftello(datafh);
 
     // GO, GO, GO
     if(create_compressed_blocks_mt()) 
@@ -920,9 +1493,16 @@ int main(int argc, char **argv)
 
     // in tempdata modes choose real values rather than guessed
     int numblocks=expected_blocks;
+    uint64_t largest=0;
+    for(size_t i=0;i<lengths.size();i++)
+        largest=max(largest, lengths[i]);
+    int length_size = largest>0xffff ? 4 : 2;
     if(targetkind) {
         numblocks=lengths.size();
-        bytes_so_far = sizeof(head) + sizeof(uint64_t) * (1+lengths.size());
+        bytes_so_far = headsize + index_size(lengths.size(), length_size)
+            + (codec_map ? lengths.size() : 0)
+            + (block_hashes ? lengths.size()*CLOOP_HASH_SIZE : 0)
+            + (basefile ? lengths.size()*sizeof(uint32_t) : 0);
     }
     else if(numblocks != lengths.size())
         die("Incorrect number of blocks detected, "<<numblocks << " vs. " << lengths.size());
@@ -958,13 +1538,25 @@ int main(int argc, char **argv)
             die("Error writting header file, " << sepheader);
     }
 
+    unsigned char uuid[16];
+    if(headsize!=sizeof(head))
+        make_uuid(uuid);
+
+    if(segments) {
+        if(!be_quiet) cerr << "Writing compressed data to segment files...\n";
+        write_segments(tofile, uuid);
+    }
+
     // seek back
     fseeko(targetfh, 0, SEEK_SET);
 
     /* Update the head... */
 
     memset(head.preamble, 0, sizeof(head.preamble));
-    memcpy(head.preamble, CLOOP_PREAMBLE, sizeof(CLOOP_PREAMBLE));
+    if(headsize==sizeof(head))
+        memcpy(head.preamble, CLOOP_PREAMBLE, sizeof(CLOOP_PREAMBLE));
+    else
+        memcpy(head.preamble, CLOOP_PREAMBLE_V3, sizeof(CLOOP_PREAMBLE_V3));
     head.block_size = htonl(blocksize);
     head.num_blocks = htonl(numblocks);
 
@@ -972,30 +1564,114 @@ int main(int argc, char **argv)
 
     fwrite(&head, sizeof(head), 1, targetfh);
 
+    if(headsize!=sizeof(head)) {
+        struct cloop_head_v3 head_v3;
+        memset(&head_v3, 0, sizeof(head_v3));
+        head_v3.compressor = compressor;
+        if(codec_map)
+            head_v3.flags |= CLOOP_FLAG_CODEC_MAP;
+        if(block_hashes)
+            head_v3.flags |= CLOOP_FLAG_BLOCK_HASHES;
+        memcpy(head_v3.uuid, uuid, sizeof(uuid));
+        if(segments) {
+            head_v3.flags |= CLOOP_FLAG_SEGMENTS;
+            head_v3.segments = segment_fh.size();
+        }
+        if(basefile) {
+            head_v3.flags |= CLOOP_FLAG_DELTA;
+            memcpy(head_v3.base_uuid, base_uuid, sizeof(base_uuid));
+        }
+        if(compact_index) {
+            head_v3.flags |= CLOOP_FLAG_COMPACT_INDEX;
+            head_v3.index_group = htons(INDEX_GROUP);
+            head_v3.index_length_size = length_size;
+        }
+        else if(dedup)
+            head_v3.flags |= CLOOP_FLAG_EXTENTS;
+        // lets the driver size its buffers without reading the whole index
+        head_v3.largest_block = htonl(largest);
+        fwrite(&head_v3, sizeof(head_v3), 1, targetfh);
+    }
+
     if(!be_quiet) cerr << "Writing index for " << lengths.size() << " block(s)...\n";
 
     /* Write offsets, then data */
 
-    // initial offset first
-    uint64_t tmp;
-    DEBUG("Initial offset: " << bytes_so_far << " at pos: " << ftello(targetfh));
-    tmp = ENSURE64UINT(bytes_so_far);
-    fwrite(&tmp, sizeof(tmp), 1, targetfh);
-
-    for(int i=0;i<lengths.size();i++) {
-        bytes_so_far += lengths[i];
+    uint64_t data_start = bytes_so_far;
+    if(compact_index) {
+        // base offset of each group, then the length of its blocks
+        uint64_t pos = bytes_so_far;
+        for(size_t i=0;i<lengths.size();i+=INDEX_GROUP) {
+            unsigned char group[8+INDEX_GROUP*4];
+            memset(group, 0, sizeof(group));
+            uint64_t base = segments ? segment_pos[i/INDEX_GROUP] : pos;
+            for(int j=0;j<8;j++)
+                group[j] = base>>(8*j);
+            for(size_t k=0;k<INDEX_GROUP && i+k<lengths.size();k++) {
+                for(int j=0;j<length_size;j++)
+                    group[8+k*length_size+j] = lengths[i+k]>>(8*j);
+                pos += lengths[i+k];
+            }
+            if(1!=fwrite(group, 8+INDEX_GROUP*length_size, 1, targetfh))
+                die("Unable to write to index area");
+        }
+    }
+    else if(dedup) {
+        // offset and length of each block, shared blocks point to the same data
+        struct cloop_extent ext;
+        memset(&ext, 0, sizeof(ext));
+        for(size_t i=0;i<lengths.size();i++) {
+            ext.offset = ENSURE64UINT(segments ? segment_pos[i] : bytes_so_far + extents[i]);
+            ext.length = htonl(lengths[i]);
+            if(1!=fwrite(&ext, sizeof(ext), 1, targetfh))
+                die("Unable to write to index area");
+        }
+    }
+    else {
+        // initial offset first
+        uint64_t tmp;
+        DEBUG("Initial offset: " << bytes_so_far << " at pos: " << ftello(targetfh));
         tmp = ENSURE64UINT(bytes_so_far);
-        if(1!=fwrite(&tmp, sizeof(tmp), 1, targetfh))
-           die("Unable to write to index area");
+        fwrite(&tmp, sizeof(tmp), 1, targetfh);
+
+        for(size_t i=0;i<lengths.size();i++) {
+            bytes_so_far += lengths[i];
+            tmp = ENSURE64UINT(bytes_so_far);
+            if(1!=fwrite(&tmp, sizeof(tmp), 1, targetfh))
+               die("Unable to write to index area");
+        }
     }
 
+    if(codec_map && codecs.size()!=fwrite(&codecs[0], 1, codecs.size(), targetfh))
+        die("Unable to write the codec map");
+
+    if(block_hashes && digests.size()!=fwrite(&digests[0], 1, digests.size(), targetfh))
+        die("Unable to write the block hashes");
+
+    if(basefile && base_refs.size()!=fwrite(&base_refs[0], sizeof(uint32_t), base_refs.size(), targetfh))
+        die("Unable to write the base map");
+
+    // space reserved for 32bit compact index lengths that were not needed
+    while((uint64_t) ftello(targetfh) < data_start)
+        fputc(0, targetfh);
+
     DEBUG("Writting data at pos: " << ftello(targetfh));
 
-    if(!be_quiet) cerr << "Writing compressed data...\n";
-    if(targetkind==TOMEM) {
+    if(!be_quiet && !segments)
+        cerr << "Writing compressed data...\n";
+    if(segments) {
+        // the data has been moved to the segment files
+        fflush(targetfh);
+        if(ftruncate(fileno(targetfh), data_start)<0)
+            die("Truncating the output file");
+        if(tempfile)
+            unlink(tempfile);
+    }
+    else if(targetkind==TOMEM) {
         for(int i=0;i<blocks.size();i++) {
             DEBUG("Dumping contents of " << i);
-            fwrite(blocks[i],lengths[i], 1, targetfh);
+            if(blocks[i]) // NULL for zero and shared blocks
+                fwrite(blocks[i],lengths[i], 1, targetfh);
         }
     }
     else if(targetkind==TOTEMPFILE) {
@@ -1205,63 +1881,3 @@ int setup_connection(char *hostname)
     return s ;
 }
 
-#if 0
-#error this is crap, stupid idea and does work worse than the split command
-string outbase, outtemp;
-
-inline void makename(size_t pos) {
-    if(!chunksize)
-        outtemp=outbase;
-    char suf = 'a' + pos/chunksize;
-    outtemp=outbase+"."+suf;
-}
-
-void split_fopen( char *path, char *mode) {
-    if(out) {
-        fclose(out);
-        out=NULL;
-    }
-    if(chunk_size) {
-        outbase=path;
-        out_mode=mode;
-        makename(0);
-        path=outtemp.c_str();
-    }
-    out=fopen(path, mode);
-}
-
-void split_fclose() {
-    if(out)
-        fclose(out);
-}
-
-/*
- * Write out or die with a meaningful error message.
- */
-int split_fwrite(void *ptr, size_t nmemb) {
-    char *src = (char *) ptr;
-    if(chunk_size) {
-        off_t curpos = ftello(realfh);
-        if( (curpos+nmemb) > chunk_size) {
-            off_t lenA=chunk_size-curpos;
-            if(lenA != fwrite(src, 1, lenA, realfh))
-                goto write_error;
-            realname[strlen(realname)-1]++;
-            fflush(realfh);
-            realfh=fopen(realname, out_mode);
-            if(!realfh) die("Problems creating "<< realname);
-            if(nmemb-lenA != fwrite(src+lenA, 1, nmemb-lenA, realfh))
-                goto write_error;
-        }
-        else {
-            if(nmemb != fwrite(ptr, 1, nmemb, realfh))
-                goto write_error;
-        }
-    }
-    else
-        return fwrite(ptr, 1, nmemb, datafh);
-    return nmemb;
-
-write_error:
-}
-#endif
@@ -8,6 +8,7 @@
  *  [64-bit file offsets of start of blocks: network order]
  *    ...
  *    (n_blocks + 1).
+ *  (version 3 images may have (offset, length) pairs instead, see cloop.h)
  * n_blocks consisting of:
  *   [compressed block]
  *
@@ -38,6 +39,7 @@
 #include <linux/sched.h>
 #include <linux/fs.h>
 #include <linux/file.h>
+#include <linux/pagemap.h>
 #include <linux/stat.h>
 #include <linux/errno.h>
 #include <linux/major.h>
@@ -47,13 +49,33 @@
 #include <asm/div64.h> /* do_div() for 64bit division */
 #include <asm/uaccess.h>
 #include <asm/byteorder.h>
+#include <asm/unaligned.h>
 /* Use zlib_inflate from lib/zlib_inflate */
 #include <linux/zutil.h>
+#if defined(CONFIG_XZ_DEC) || defined(CONFIG_XZ_DEC_MODULE)
+#define CLOOP_HAVE_XZ
+#include <linux/xz.h>
+#endif
+#if defined(CONFIG_LZ4_DECOMPRESS) || defined(CONFIG_LZ4_DECOMPRESS_MODULE)
+#define CLOOP_HAVE_LZ4
+#include <linux/lz4.h>
+#endif
 #include <linux/loop.h>
 #include <linux/kthread.h>
 #include <linux/compat.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/ioprio.h>
+#include <linux/bitmap.h>
+#include <linux/llist.h>
+#include <linux/shrinker.h>
+#include <crypto/hash.h>
+#include <crypto/sha.h>
 #include "cloop.h"
 
+#define CREATE_TRACE_POINTS
+#include "cloop_trace.h"
+
 /* New License scheme */
 #ifdef MODULE_LICENSE
 MODULE_LICENSE("GPL");
@@ -84,6 +106,7 @@ MODULE_DESCRIPTION("Transparently decompressing loopback block device");
 /* #define TIMEOUT_VALUE (6 * HZ) */
 
 #include <linux/blkdev.h>
+#include <linux/blk-mq.h>
 #include <linux/buffer_head.h>
 
 #if 0
@@ -96,54 +119,289 @@ MODULE_DESCRIPTION("Transparently decompressing loopback block device");
 /* insmod cloop file=/path/to/file */
 static char *file=NULL;
 static unsigned int preload=0;
+static bool preload_compressed=false;
+static bool direct_io=false;
 static unsigned int cloop_max=CLOOP_MAX;
+/* Default number of buffered decompressed blocks */
+#define BUFFERED_BLOCKS 8
+static unsigned int cache_blocks=BUFFERED_BLOCKS;
+static unsigned int workers=0;
+/* Default number of blocks read ahead behind a request */
+#define READAHEAD_BLOCKS 8
+static unsigned int readahead=READAHEAD_BLOCKS;
+/* Default number of cached pages of the block index */
+#define INDEX_PAGES 256
+static unsigned int index_pages=INDEX_PAGES;
+static unsigned int record=0;
+static unsigned int shared_cache=0;
+/* Segment files of a segmented initial file, in order */
+static char *segments[CLOOP_MAX_SEGMENTS];
+static int nsegments=0;
 module_param(file, charp, 0);
 module_param(preload, uint, 0);
+module_param(preload_compressed, bool, 0);
+module_param(direct_io, bool, 0);
 module_param(cloop_max, uint, 0);
+module_param(cache_blocks, uint, 0);
+module_param(workers, uint, 0);
+module_param(readahead, uint, 0644);
+module_param(index_pages, uint, 0);
+module_param(record, uint, 0);
+module_param(shared_cache, uint, 0);
+module_param_array(segments, charp, &nsegments, 0);
 MODULE_PARM_DESC(file, "Initial cloop image file (full path) for /dev/cloop");
 MODULE_PARM_DESC(preload, "Preload n blocks of cloop data into memory");
+MODULE_PARM_DESC(preload_compressed, "Keep preloaded blocks compressed, uncompress them when read");
+MODULE_PARM_DESC(direct_io, "Read compressed data with direct I/O, bypassing the page cache of the backing file");
 MODULE_PARM_DESC(cloop_max, "Maximum number of cloop devices (default 8)");
+MODULE_PARM_DESC(cache_blocks, "Number of uncompressed blocks cached per device (default 8)");
+MODULE_PARM_DESC(workers, "Number of hardware queues and decompression threads per device (default: number of online CPUs)");
+MODULE_PARM_DESC(readahead, "Number of blocks read ahead from the backing file behind each request (default 8)");
+MODULE_PARM_DESC(index_pages, "Number of block index pages cached per device (default 256)");
+MODULE_PARM_DESC(record, "Record the order of the first n blocks read after attaching, see CLOOP_GET_RECORD");
+MODULE_PARM_DESC(shared_cache, "Number of uncompressed blocks cached for all devices by content, for images with block hashes (default 0: off)");
+MODULE_PARM_DESC(segments, "Segment files (full paths, comma separated) of a segmented initial file");
 
 static struct file *initial_file=NULL;
 static int cloop_major=MAJOR_NR;
 
-/* Number of buffered decompressed blocks */
-#define BUFFERED_BLOCKS 8
-struct cloop_device
+/* States of a cache entry */
+#define CLOOP_BLOCK_EMPTY   0 /* slot is unused */
+#define CLOOP_BLOCK_LOADING 1 /* on fetch_list, or being loaded by a worker */
+#define CLOOP_BLOCK_VALID   2
+#define CLOOP_BLOCK_ERROR   3 /* load failed, slot is freed with the last reference */
+
+/* Priority classes of the work of a worker, in the order they are served:
+ * demand reads come before readahead requests and the blocks the warm-up
+ * thread asks for. Preloading is done only when there is nothing else. */
+#define CLOOP_PRIO_DEMAND     0
+#define CLOOP_PRIO_BACKGROUND 1
+#define CLOOP_PRIO_CLASSES    2
+
+/* Cache buffers given back at once under memory pressure, and taken back
+ * after a request, not before CLOOP_CACHE_GROW_DELAY after the last reclaim */
+#define CLOOP_SHRINK_BATCH 32
+#define CLOOP_CACHE_GROW 4
+#define CLOOP_CACHE_GROW_DELAY HZ
+
+/* Compressed preload data is read from the backing file in pieces of this size */
+#define CLOOP_PRELOAD_CHUNK (256 * 1024)
+
+/* Most pages read with one direct I/O */
+#define CLOOP_DIRECT_PAGES 16
+
+/* Most blocks, and bytes, loaded with one read from the backing file */
+#define CLOOP_MAX_BATCH 16
+#define CLOOP_BATCH_BYTES (128*1024)
+
+/* One slot of the uncompressed block cache */
+struct cloop_cache_entry
 {
- /* Copied straight from the file */
- struct cloop_head head;
+ int blocknum;            /* -1 if slot is unused */
+ int state;               /* CLOOP_BLOCK_* */
+ int refcnt;              /* requests using this block, can't be evicted */
+ struct hlist_node hash;  /* chained in cache.hash[blocknum & hash_mask] */
+ struct list_head lru;    /* most recently used first */
+ struct list_head fetch;  /* on fetch_list while waiting for a worker */
+ int prio;                /* CLOOP_PRIO_* of the fetch_list it is on */
+ char *data;              /* block_size bytes, NULL if taken by the shrinker */
+};
+
+/* LRU cache of uncompressed blocks with hashed lookup */
+struct cloop_cache
+{
+ struct cloop_cache_entry *entries;
+ struct hlist_head *hash;
+ unsigned int size;       /* Number of entries */
+ unsigned int hash_mask;  /* Number of hash chains - 1 */
+ unsigned int backed;     /* Number of entries with a data buffer */
+ struct list_head lru;
+ u_int64_t hits, misses, evictions;
+ u_int64_t reclaims;      /* buffers freed under memory pressure */
+};
+
+/* Blocks of images with block hashes are also kept in a cache of all
+ * devices, where they are found by their hash and block size. Images that
+ * have a block in common uncompress it only once. It is a second layer
+ * behind the caches of the devices, which get a copy of the blocks found
+ * there, so it takes shared_cache blocks of memory on top of them. A block
+ * is only added if it matches its hash, so an image can't hand wrong data
+ * to the others. */
+struct cloop_shared_block
+{
+ u_int8_t hash[CLOOP_HASH_SIZE];
+ u_int32_t block_size;
+ int refcnt;              /* workers copying from it */
+ struct hlist_node node;  /* chained in cloop_shared_hash */
+ struct list_head lru;    /* most recently used first */
+ char data[0];            /* block_size bytes */
+};
+
+static DEFINE_SPINLOCK(cloop_shared_lock); /* protects all of the shared cache */
+static struct hlist_head *cloop_shared_hash;
+static unsigned int cloop_shared_hash_mask;
+static unsigned int cloop_shared_count;
+static LIST_HEAD(cloop_shared_lru);
+static struct crypto_shash *cloop_shared_sha256;
 
- /* An array of offsets of compressed blocks within the file */
- loff_t *offsets;
+/* Protects base_ready and deltas of all devices. A delta image looks for
+ * its base with its own clo_ctl_mutex held, taking the one of the base then
+ * could deadlock with the base doing the same. */
+static DEFINE_MUTEX(cloop_base_mutex);
 
- /* We buffer some uncompressed blocks for performance */
- int buffered_blocknum[BUFFERED_BLOCKS];
- int current_bufnum;
- void *buffer[BUFFERED_BLOCKS];
- void *compressed_buffer;
- size_t preload_array_size; /* Size of pointer array in blocks */
- size_t preload_size;       /* Number of successfully allocated blocks */
- char **preload_cache;      /* Pointers to preloaded blocks */
+/* Latency histograms have a bucket for each power of two microseconds,
+ * bucket n counts times below 2^n us, the last one all longer ones. */
+#define CLOOP_LATENCY_BUCKETS 20
 
+/* Counters of a device, one set per CPU, added up when read from sysfs */
+struct cloop_stats
+{
+ u_int64_t requests;            /* completed requests */
+ u_int64_t request_errors;      /* of those, the failed ones */
+ u_int64_t bytes;               /* bytes read from the device */
+ u_int64_t preload_hits;        /* blocks found in the preload cache */
+ u_int64_t shared_hits;         /* blocks found in the shared cache */
+ u_int64_t base_blocks;         /* blocks taken from the base image */
+ u_int64_t stored_blocks;       /* blocks read from the file without uncompressing */
+ u_int64_t uncompressed_blocks; /* blocks uncompressed */
+ u_int64_t inflated_blocks;     /* of those, straight into a request's pages */
+ u_int64_t backing_reads;       /* reads from the backing file */
+ u_int64_t backing_bytes;       /* bytes read from the backing file */
+ u_int64_t read_latency[CLOOP_LATENCY_BUCKETS];    /* backing file reads */
+ u_int64_t inflate_latency[CLOOP_LATENCY_BUCKETS]; /* uncompressing a block */
+ u_int64_t request_latency[CLOOP_LATENCY_BUCKETS]; /* queued to completed */
+};
+
+struct cloop_device;
+
+/* Requests that a hardware queue may have in flight */
+#define CLOOP_QUEUE_DEPTH 128
+
+/* Our part of each request, see blk_mq_rq_to_pdu() */
+struct cloop_cmd
+{
+ struct llist_node node;  /* on the worker's clo_list */
+ ktime_t queued;          /* when it was queued, for request_latency */
+ int prio;                /* CLOOP_PRIO_* */
+};
+
+/* A decompression thread serving one blk-mq hardware queue, with its own
+ * request list, zlib state and buffers. Requests are handed over without
+ * a lock, cloop_queue_rq() pushes them on the clo_list of their priority
+ * class and the worker takes all of them at once. */
+struct cloop_worker
+{
+ struct cloop_device *clo;
+ int number;
+ int node;                 /* NUMA node of its hardware queue's CPUs */
+ struct task_struct *thread;
+ struct llist_head clo_list[CLOOP_PRIO_CLASSES]; /* newest request first */
+ struct llist_node *pending[CLOOP_PRIO_CLASSES]; /* taken from clo_list, oldest first */
+ atomic_t queued;          /* requests not taken up yet */
+ atomic_t queued_max;      /* most requests ever waiting */
+ atomic_t class_queued[CLOOP_PRIO_CLASSES]; /* of those, per class */
+ int prio;                 /* class of the work being done */
+ wait_queue_head_t clo_event; /* new requests or fetch_list entries */
  z_stream zstream;
+#ifdef CLOOP_HAVE_XZ
+ struct xz_dec *xz;
+#endif
+ void *compressed_buffer;  /* compressed_size bytes */
+ size_t compressed_alloc;  /* more, to align direct I/O */
+ size_t compressed_size;   /* at least largest_block, for coalesced reads */
+ char *buffer;             /* block_size bytes, used if the cache is full */
+ int max_batch;            /* most blocks loaded with one read */
+ ktime_t inflate_start;    /* when the block being uncompressed into pages was read */
+};
+
+struct cloop_device
+{
+ /* Copied straight from the file */
+ struct cloop_head head;
+ int compressor; /* CLOOP_COMPRESSOR_* of all blocks */
+ u_int8_t *codec_map; /* CLOOP_COMPRESSOR_* per block, overrides compressor */
+ u_int8_t *block_hashes; /* CLOOP_HASH_SIZE bytes per block, only with shared_cache */
+ u_int8_t uuid[16];   /* of the image, zero for V2 images */
+ struct cloop_device *base; /* of a delta image, counted in its deltas */
+ u_int32_t *base_map; /* base block + 1 per block, network order */
+ struct cloop_worker base_worker; /* loads blocks of base, see cloop_load_base() */
+ struct mutex base_mutex;   /* held while base_worker is in use */
+ int base_ready;            /* attached, delta images may use it as base */
+ int deltas;                /* delta images using it as base */
+ unsigned int compressors; /* bit mask of the CLOOP_COMPRESSOR_* in use */
+
+ /* The index of compressed blocks within the file is read on demand,
+  * a page at a time. Its entries are num_blocks+1 offsets, or, for images
+  * with shared and zero blocks, an offset and length per block, or groups
+  * of index_group blocks in a compact index. */
+ loff_t index_start;            /* file position of the index */
+ size_t index_size;             /* in bytes */
+ unsigned int index_entry_size; /* size of one offset, extent or group */
+ unsigned int index_per_page;   /* entries in one page of index_cache */
+ unsigned int index_group;      /* blocks per group, 0 if not compact */
+ unsigned int index_length_size; /* bytes per length in a compact index */
+ int index_last;                /* block of the last compact index lookup, or -1 */
+ loff_t index_last_pos;         /* and its offset, see cloop_block_extent() */
+ struct cloop_cache index_cache; /* LRU cache of index pages */
+ spinlock_t index_lock;         /* protects index_cache and index_last */
+ struct mutex index_mutex;      /* held while loading an index page */
+ char *index_spare;             /* PAGE_SIZE buffer for loading a page */
+
+ /* We cache some uncompressed blocks for performance */
+ struct cloop_cache cache;
+ unsigned int cache_blocks; /* Requested cache size in blocks */
+ unsigned int cache_low;    /* Buffers left to the cache under memory pressure */
+ unsigned long cache_shrunk; /* jiffies of the last reclaim */
+ struct shrinker cache_shrinker;
+ int shrinker_registered;
+ spinlock_t cache_lock;     /* protects cache entries and fetch_lists */
+ struct rw_semaphore clo_cache_rwsem; /* held for writing to resize the cache */
+ struct list_head fetch_list[CLOOP_PRIO_CLASSES]; /* cache entries waiting to be loaded */
+ wait_queue_head_t cache_event; /* a cache entry was loaded */
+ /* The first blocks of the image, uncompressed, or with preload_compressed
+  * their compressed data from file offset preload_pos on, in one buffer */
+ char *preload_data;
+ size_t preload_bytes;      /* size of preload_data */
+ loff_t preload_pos;
+ int preload_compressed;
+ size_t preload_size;       /* Number of blocks, or CLOOP_PRELOAD_CHUNKs */
+ unsigned long *preload_map; /* bit per block or chunk, set when it is valid */
+ atomic_t preload_next;     /* next one to be preloaded by the workers */
+ atomic_t preload_done;     /* ones the workers are through with */
+
+ /* Decompression threads, one per hardware queue */
+ struct cloop_worker *workers;
+ unsigned int num_workers;
+
+ struct cloop_stats __percpu *stats; /* shown in /sys/block/cloopN/cloop/ */
+
+ /* Order in which blocks are first read, replaced while holding
+  * clo_cache_rwsem for writing */
+ unsigned long *record_map;  /* bit per block, set when it is first read */
+ u_int32_t *record;          /* block numbers in the order of first read */
+ unsigned int record_size;   /* entries of record */
+ atomic_t record_count;      /* blocks read first, may exceed record_size */
+
+ /* Background loading of a list of blocks, see CLOOP_WARMUP */
+ struct cloop_worker warm;   /* not serving a hardware queue */
+ u_int32_t *warm_list;
+ unsigned int warm_count;
 
  struct file   *backing_file;  /* associated file */
  struct inode  *backing_inode; /* for bmap */
+ struct file   **segment_files; /* of a segmented image, segment n is [n-1] */
+ unsigned int  segment_count;
 
  unsigned long largest_block;
  unsigned int underlying_blksize;
+ int direct_io;               /* read compressed data with direct I/O */
  int clo_number;
  int refcnt;
  struct block_device *bdev;
  int isblkdev;
- /* Lock for kernel block device queue */
- spinlock_t queue_lock;
  /* mutex for ioctl() */
  struct mutex clo_ctl_mutex;
- struct list_head clo_list;
- struct task_struct *clo_thread;
- wait_queue_head_t clo_event;
+ struct blk_mq_tag_set tag_set;
  struct request_queue *clo_queue;
  struct gendisk *clo_disk;
  int suspended;
@@ -160,58 +418,555 @@ static int cloop_count = 0;
 #error  "Invalid Kernel configuration. CONFIG_ZLIB_INFLATE support is needed for cloop."
 #endif
 
-/* Use __get_free_pages instead of vmalloc, allows up to 32 pages,
- * 2MB in one piece */
-static void *cloop_malloc(size_t size)
+/* Other compressors are optional, images using them are refused if missing. */
+static const char *cloop_compressor_names[CLOOP_COMPRESSOR_MAX] =
+ { "zlib", "xz", "lz4", "unknown", "none" };
+
+/* Image flags we know how to handle */
+#define CLOOP_FLAGS_SUPPORTED (CLOOP_FLAG_CODEC_MAP|CLOOP_FLAG_EXTENTS|CLOOP_FLAG_COMPACT_INDEX|\
+                               CLOOP_FLAG_BLOCK_HASHES|CLOOP_FLAG_DELTA|CLOOP_FLAG_SEGMENTS)
+
+/* Bytes allocated with cloop_malloc() by all devices, in physically
+ * contiguous memory and with vmalloc, see /sys/module/cloop/parameters/ */
+static atomic_long_t cloop_mem_contiguous = ATOMIC_LONG_INIT(0);
+static atomic_long_t cloop_mem_vmalloc = ATOMIC_LONG_INIT(0);
+
+static int cloop_mem_get(char *buf, const struct kernel_param *kp)
+{
+ return sprintf(buf, "%ld", atomic_long_read((atomic_long_t *) kp->arg));
+}
+
+static const struct kernel_param_ops cloop_mem_ops = { .get = cloop_mem_get };
+module_param_cb(mem_contiguous, &cloop_mem_ops, &cloop_mem_contiguous, 0444);
+module_param_cb(mem_vmalloc, &cloop_mem_ops, &cloop_mem_vmalloc, 0444);
+MODULE_PARM_DESC(mem_contiguous, "Bytes of buffers in physically contiguous memory (read only)");
+MODULE_PARM_DESC(mem_vmalloc, "Bytes of buffers in vmalloc memory (read only)");
+
+/* Physically contiguous memory is in the kernel's direct mapping, which is
+ * mapped with huge pages, so the decompressors and block copies take fewer
+ * TLB misses than with vmalloc, which maps every page on its own. Larger
+ * kmalloc()s come as compound pages straight from the page allocator. After
+ * the system is running for a while, large orders often can't be had, so
+ * don't make the allocator try hard, use vmalloc then. Memory is taken
+ * from NUMA node "node" if possible, any node with NUMA_NO_NODE. */
+static void *cloop_malloc_node(size_t size, int node)
+{
+ void *mem = NULL;
+ if(size <= KMALLOC_MAX_SIZE)
+  mem = kmalloc_node(size, GFP_KERNEL | __GFP_NOWARN | __GFP_NORETRY, node);
+ if(mem)
+  {
+   atomic_long_add(size, &cloop_mem_contiguous);
+   return mem;
+  }
+ if((mem = vmalloc_node(size, node)) != NULL)
+  atomic_long_add(size, &cloop_mem_vmalloc);
+ return mem;
+}
+
+static inline void *cloop_malloc(size_t size)
 {
- /* kmalloc will fail after the system is running for a while, */
- /* when large orders can't return contiguous memory. */
- /* Let's just use vmalloc for now. :-/ */
- /* int order = get_order(size); */
- /* if(order <= KMALLOC_MAX_ORDER) */
- /*  return (void *)kmalloc(size, GFP_KERNEL); */
- /* else if(order < MAX_ORDER) */
- /*  return (void *)__get_free_pages(GFP_KERNEL, order); */
- return (void *)vmalloc(size);
+ return cloop_malloc_node(size, NUMA_NO_NODE);
+}
+
+/* Only succeeds if there is free memory, no memory is reclaimed for it */
+static void *cloop_malloc_nowait(size_t size)
+{
+ void *mem = NULL;
+ if(size <= KMALLOC_MAX_SIZE)
+  mem = kmalloc(size, GFP_NOWAIT | __GFP_NOWARN);
+ if(mem) atomic_long_add(size, &cloop_mem_contiguous);
+ return mem;
 }
 
 static void cloop_free(void *mem, size_t size)
 {
- /* int order = get_order(size); */
- /* if(order <= KMALLOC_MAX_ORDER) */
- /*  kfree(mem); */
- /* else if(order < MAX_ORDER) */
- /*  free_pages((unsigned long)mem, order); */
- /* else */
- vfree(mem);
+ if(mem == NULL) return;
+ if(is_vmalloc_addr(mem))
+  {
+   vfree(mem);
+   atomic_long_sub(size, &cloop_mem_vmalloc);
+  }
+ else
+  {
+   kfree(mem);
+   atomic_long_sub(size, &cloop_mem_contiguous);
+  }
+}
+
+/* Histogram bucket for the time since start */
+static inline int cloop_latency_bucket(ktime_t start)
+{
+ s64 us = ktime_us_delta(ktime_get(), start);
+ return (us <= 0) ? 0 : MIN(fls64(us), CLOOP_LATENCY_BUCKETS - 1);
 }
 
-static int uncompress(struct cloop_device *clo,
-                      unsigned char *dest, unsigned long *destLen,
-                      unsigned char *source, unsigned long sourceLen)
+/* Count an event, or its time since start, in the statistics of clo */
+#define cloop_stat_inc(clo, name) this_cpu_inc((clo)->stats->name)
+#define cloop_stat_add(clo, name, n) this_cpu_add((clo)->stats->name, n)
+#define cloop_stat_latency(clo, name, start) \
+ this_cpu_inc((clo)->stats->name[cloop_latency_bucket(start)])
+
+/* Start counting from zero for a new file */
+static void cloop_stats_reset(struct cloop_device *clo)
+{
+ int cpu, i;
+ for_each_possible_cpu(cpu)
+  memset(per_cpu_ptr(clo->stats, cpu), 0, sizeof(struct cloop_stats));
+ for(i=0; i<clo->num_workers; i++)
+  atomic_set(&clo->workers[i].queued_max, atomic_read(&clo->workers[i].queued));
+}
+
+/* Allocate the block cache with "size" empty entries */
+static int cloop_cache_alloc(struct cloop_cache *cache, unsigned int size,
+                             size_t block_size)
+{
+ unsigned int i, hash_size;
+ memset(cache, 0, sizeof(struct cloop_cache));
+ INIT_LIST_HEAD(&cache->lru);
+ if(size < 1) size = 1;
+ for(hash_size = 1; hash_size < size; hash_size <<= 1);
+ cache->entries = cloop_malloc(size * sizeof(struct cloop_cache_entry));
+ cache->hash = cloop_malloc(hash_size * sizeof(struct hlist_head));
+ if(!cache->entries || !cache->hash) goto error_free;
+ memset(cache->entries, 0, size * sizeof(struct cloop_cache_entry));
+ cache->size = size;
+ cache->backed = block_size ? size : 0;
+ cache->hash_mask = hash_size - 1;
+ for(i=0; i<hash_size; i++) INIT_HLIST_HEAD(&cache->hash[i]);
+ for(i=0; i<size; i++)
+  {
+   struct cloop_cache_entry *entry = &cache->entries[i];
+   entry->blocknum = -1;
+   entry->state = CLOOP_BLOCK_EMPTY;
+   INIT_HLIST_NODE(&entry->hash);
+   INIT_LIST_HEAD(&entry->fetch);
+   list_add_tail(&entry->lru, &cache->lru);
+   if(block_size && (entry->data = cloop_malloc(block_size)) == NULL)
+    goto error_free;
+  }
+ return 0;
+error_free:
+ if(cache->entries)
+  {
+   for(i=0; i<size; i++)
+    if(cache->entries[i].data) cloop_free(cache->entries[i].data, block_size);
+   cloop_free(cache->entries, size * sizeof(struct cloop_cache_entry));
+  }
+ if(cache->hash) cloop_free(cache->hash, hash_size * sizeof(struct hlist_head));
+ memset(cache, 0, sizeof(struct cloop_cache));
+ return -ENOMEM;
+}
+
+static void cloop_cache_free(struct cloop_cache *cache, size_t block_size)
+{
+ unsigned int i;
+ if(!cache->entries) return;
+ for(i=0; i<cache->size; i++)
+  if(cache->entries[i].data) cloop_free(cache->entries[i].data, block_size);
+ cloop_free(cache->entries, cache->size * sizeof(struct cloop_cache_entry));
+ cloop_free(cache->hash, (cache->hash_mask + 1) * sizeof(struct hlist_head));
+ memset(cache, 0, sizeof(struct cloop_cache));
+}
+
+static struct cloop_cache_entry *cloop_cache_lookup(struct cloop_cache *cache,
+                                                    int blocknum)
+{
+ struct cloop_cache_entry *entry;
+ hlist_for_each_entry(entry, &cache->hash[blocknum & cache->hash_mask], hash)
+  if(entry->blocknum == blocknum) return entry;
+ return NULL;
+}
+
+/* Change the number of cache slots of an attached device, keeping the most
+ * recently used blocks. Block buffers are moved, not copied. Waits for all
+ * running requests to finish, so no entry is referenced or loading. */
+static int cloop_cache_resize(struct cloop_device *clo, unsigned int size)
+{
+ struct cloop_cache new_cache, old_cache;
+ struct cloop_cache_entry *entry;
+ size_t block_size = ntohl(clo->head.block_size);
+ unsigned int i = 0;
+ int error;
+ if(size < 1) size = 1;
+ /* Allocate buffers only for the slots that we can't take over */
+ error = cloop_cache_alloc(&new_cache, size, 0);
+ if(error) return error;
+ for(i=clo->cache.size; i<size; i++)
+  {
+   if((new_cache.entries[i].data = cloop_malloc(block_size)) == NULL)
+    {
+     cloop_cache_free(&new_cache, block_size);
+     return -ENOMEM;
+    }
+  }
+ down_write(&clo->clo_cache_rwsem);
+ spin_lock(&clo->cache_lock);
+ i = 0;
+ list_for_each_entry(entry, &clo->cache.lru, lru)
+  {
+   struct cloop_cache_entry *n;
+   if(i >= size) break;
+   n = &new_cache.entries[i++];
+   n->data = entry->data; entry->data = NULL;
+   n->blocknum = entry->blocknum;
+   n->state = entry->state;
+   if(n->blocknum >= 0)
+    hlist_add_head(&n->hash, &new_cache.hash[n->blocknum & new_cache.hash_mask]);
+  }
+ /* The new entries are already in LRU order, because cloop_cache_alloc()
+  * queued them in index order. */
+ for(i=0; i<size; i++)
+  if(new_cache.entries[i].data) new_cache.backed++;
+ new_cache.hits      = clo->cache.hits;
+ new_cache.misses    = clo->cache.misses;
+ new_cache.evictions = clo->cache.evictions;
+ new_cache.reclaims  = clo->cache.reclaims;
+ old_cache = clo->cache; /* only needed for cloop_cache_free() */
+ clo->cache = new_cache;
+ /* The list head moved, fix up the pointers of its neighbours. */
+ list_replace(&new_cache.lru, &clo->cache.lru);
+ clo->cache_blocks = size;
+ spin_unlock(&clo->cache_lock);
+ up_write(&clo->clo_cache_rwsem);
+ cloop_cache_free(&old_cache, block_size);
+ return 0;
+}
+
+/* Under memory pressure, the kernel takes buffers of cold cache entries
+ * through this shrinker, down to cache_low of them. The entries stay in
+ * the cache without a buffer, until cloop_cache_grow() finds free memory
+ * for them again. It can only get them from kmalloc(), so blocks larger
+ * than that keep their buffers. */
+static unsigned long cloop_cache_count(struct shrinker *shrinker, struct shrink_control *sc)
+{
+ struct cloop_device *clo = container_of(shrinker, struct cloop_device, cache_shrinker);
+ unsigned int backed = ACCESS_ONCE(clo->cache.backed), low = ACCESS_ONCE(clo->cache_low);
+ if(ntohl(clo->head.block_size) > KMALLOC_MAX_SIZE) return 0;
+ return (backed > low) ? backed - low : 0;
+}
+
+static unsigned long cloop_cache_scan(struct shrinker *shrinker, struct shrink_control *sc)
+{
+ struct cloop_device *clo = container_of(shrinker, struct cloop_device, cache_shrinker);
+ size_t block_size = ntohl(clo->head.block_size);
+ unsigned long freed = 0;
+ int i, n;
+ /* The cache may be resized or dropped meanwhile, don't wait for that */
+ if(!down_read_trylock(&clo->clo_cache_rwsem)) return SHRINK_STOP;
+ do
+  {
+   char *victims[CLOOP_SHRINK_BATCH];
+   struct cloop_cache_entry *entry;
+   n = 0;
+   spin_lock(&clo->cache_lock);
+   /* Least recently used first, entries in use are skipped */
+   list_for_each_entry_reverse(entry, &clo->cache.lru, lru)
+    {
+     if(n >= CLOOP_SHRINK_BATCH || freed + n >= sc->nr_to_scan ||
+        clo->cache.backed <= clo->cache_low) break;
+     if(entry->data == NULL || entry->refcnt > 0 ||
+        entry->state == CLOOP_BLOCK_LOADING) continue;
+     if(entry->state != CLOOP_BLOCK_EMPTY) hlist_del_init(&entry->hash);
+     entry->blocknum = -1;
+     entry->state = CLOOP_BLOCK_EMPTY;
+     victims[n++] = entry->data;
+     entry->data = NULL;
+     clo->cache.backed--;
+     clo->cache.reclaims++;
+    }
+   spin_unlock(&clo->cache_lock);
+   /* vfree() must not be called with a spinlock held */
+   for(i=0; i<n; i++) cloop_free(victims[i], block_size);
+   freed += n;
+  } while(n == CLOOP_SHRINK_BATCH && freed < sc->nr_to_scan);
+ up_read(&clo->clo_cache_rwsem);
+ if(freed == 0) return SHRINK_STOP;
+ clo->cache_shrunk = jiffies;
+ return freed;
+}
+
+/* Give buffers back to cache entries that the shrinker took them from, if
+ * there is free memory again. Called by the workers after a request, with
+ * clo_cache_rwsem held for reading. */
+static void cloop_cache_grow(struct cloop_device *clo)
+{
+ size_t block_size = ntohl(clo->head.block_size);
+ int i;
+ if(ACCESS_ONCE(clo->cache.backed) >= clo->cache.size ||
+    time_before(jiffies, clo->cache_shrunk + CLOOP_CACHE_GROW_DELAY)) return;
+ for(i=0; i<CLOOP_CACHE_GROW; i++)
+  {
+   struct cloop_cache_entry *entry;
+   char *data = cloop_malloc_nowait(block_size);
+   if(data == NULL) return;
+   spin_lock(&clo->cache_lock);
+   list_for_each_entry_reverse(entry, &clo->cache.lru, lru)
+    if(entry->data == NULL)
+     {
+      entry->data = data;
+      data = NULL;
+      clo->cache.backed++;
+      break;
+     }
+   spin_unlock(&clo->cache_lock);
+   if(data) { cloop_free(data, block_size); return; } /* all have one */
+  }
+}
+
+/* The hash of a block, NULL if it has none or the shared cache is off */
+static inline const u_int8_t *cloop_block_hash(struct cloop_device *clo, int blocknum)
+{
+ const u_int8_t *hash;
+ if(clo->block_hashes == NULL) return NULL;
+ hash = clo->block_hashes + (size_t) blocknum * CLOOP_HASH_SIZE;
+ return memchr_inv(hash, 0, CLOOP_HASH_SIZE) ? hash : NULL;
+}
+
+/* Must be called with cloop_shared_lock held. */
+static struct cloop_shared_block *cloop_shared_lookup(const u_int8_t *hash, u_int32_t block_size)
+{
+ struct cloop_shared_block *b;
+ hlist_for_each_entry(b, &cloop_shared_hash[get_unaligned_le32(hash) & cloop_shared_hash_mask], node)
+  if(b->block_size == block_size && !memcmp(b->hash, hash, CLOOP_HASH_SIZE)) return b;
+ return NULL;
+}
+
+/* Copy block blocknum from the shared cache to dest. Returns 1 if it was
+ * there, 0 if it has to be uncompressed. */
+static int cloop_shared_get(struct cloop_device *clo, int blocknum, char *dest)
+{
+ const u_int8_t *hash = cloop_block_hash(clo, blocknum);
+ u_int32_t block_size = ntohl(clo->head.block_size);
+ struct cloop_shared_block *b;
+ if(hash == NULL) return 0;
+ spin_lock(&cloop_shared_lock);
+ if((b = cloop_shared_lookup(hash, block_size)) != NULL)
+  {
+   b->refcnt++;
+   list_move(&b->lru, &cloop_shared_lru);
+  }
+ spin_unlock(&cloop_shared_lock);
+ if(b == NULL) return 0;
+ /* Copied without the lock, the reference keeps it from being replaced */
+ memcpy(dest, b->data, block_size);
+ spin_lock(&cloop_shared_lock);
+ b->refcnt--;
+ spin_unlock(&cloop_shared_lock);
+ cloop_stat_inc(clo, shared_hits);
+ return 1;
+}
+
+/* Does the uncompressed block match the hash that its image gives? */
+static int cloop_shared_check(const u_int8_t *hash, const char *data, u_int32_t block_size)
+{
+ SHASH_DESC_ON_STACK(desc, cloop_shared_sha256);
+ u_int8_t digest[SHA256_DIGEST_SIZE];
+ desc->tfm = cloop_shared_sha256;
+ desc->flags = 0;
+ if(crypto_shash_digest(desc, (const u8 *) data, block_size, digest) != 0) return 0;
+ return !memcmp(digest, hash, CLOOP_HASH_SIZE);
+}
+
+/* Put a copy of the uncompressed block blocknum into the shared cache. If
+ * it is full, the buffer of the least recently used unreferenced block is
+ * taken for it. May sleep. */
+static void cloop_shared_add(struct cloop_device *clo, int blocknum, const char *data)
+{
+ const u_int8_t *hash = cloop_block_hash(clo, blocknum);
+ u_int32_t block_size = ntohl(clo->head.block_size);
+ struct cloop_shared_block *b = NULL, *old;
+ if(hash == NULL) return;
+ spin_lock(&cloop_shared_lock);
+ if(cloop_shared_lookup(hash, block_size) != NULL)
+  {
+   spin_unlock(&cloop_shared_lock);
+   return;
+  }
+ spin_unlock(&cloop_shared_lock);
+ if(!cloop_shared_check(hash, data, block_size))
+  {
+   printk_ratelimited(KERN_WARNING "%s%d: block %d does not match its hash, not shared.\n",
+                      cloop_name, clo->clo_number, blocknum);
+   return;
+  }
+ spin_lock(&cloop_shared_lock);
+ if(cloop_shared_count >= shared_cache)
+  {
+   list_for_each_entry_reverse(old, &cloop_shared_lru, lru)
+    if(old->refcnt == 0) { b = old; break; }
+   if(b == NULL)
+    { /* All being copied from, forget this one */
+     spin_unlock(&cloop_shared_lock);
+     return;
+    }
+   hlist_del(&b->node);
+   list_del(&b->lru);
+   cloop_shared_count--;
+  }
+ spin_unlock(&cloop_shared_lock);
+ if(b && b->block_size != block_size)
+  {
+   cloop_free(b, sizeof(struct cloop_shared_block) + b->block_size);
+   b = NULL;
+  }
+ if(b == NULL && (b = cloop_malloc(sizeof(struct cloop_shared_block) + block_size)) == NULL)
+  return;
+ memcpy(b->hash, hash, CLOOP_HASH_SIZE);
+ b->block_size = block_size;
+ b->refcnt = 0;
+ memcpy(b->data, data, block_size);
+ spin_lock(&cloop_shared_lock);
+ /* Another worker may have added it meanwhile */
+ if(cloop_shared_count >= shared_cache || cloop_shared_lookup(hash, block_size) != NULL)
+  {
+   spin_unlock(&cloop_shared_lock);
+   cloop_free(b, sizeof(struct cloop_shared_block) + block_size);
+   return;
+  }
+ hlist_add_head(&b->node, &cloop_shared_hash[get_unaligned_le32(hash) & cloop_shared_hash_mask]);
+ list_add(&b->lru, &cloop_shared_lru);
+ cloop_shared_count++;
+ spin_unlock(&cloop_shared_lock);
+}
+
+static int cloop_shared_alloc(void)
+{
+ unsigned int i, hash_size;
+ cloop_shared_sha256 = crypto_alloc_shash("sha256", 0, 0);
+ if(IS_ERR(cloop_shared_sha256))
+  {
+   int error = PTR_ERR(cloop_shared_sha256);
+   cloop_shared_sha256 = NULL;
+   return error;
+  }
+ for(hash_size = 1; hash_size < shared_cache; hash_size <<= 1);
+ cloop_shared_hash = cloop_malloc(hash_size * sizeof(struct hlist_head));
+ if(cloop_shared_hash == NULL)
+  {
+   crypto_free_shash(cloop_shared_sha256);
+   cloop_shared_sha256 = NULL;
+   return -ENOMEM;
+  }
+ for(i=0; i<hash_size; i++) INIT_HLIST_HEAD(&cloop_shared_hash[i]);
+ cloop_shared_hash_mask = hash_size - 1;
+ return 0;
+}
+
+/* When the module is unloaded, no device is attached anymore */
+static void cloop_shared_free(void)
+{
+ struct cloop_shared_block *b, *next;
+ if(cloop_shared_hash == NULL) return;
+ list_for_each_entry_safe(b, next, &cloop_shared_lru, lru)
+  cloop_free(b, sizeof(struct cloop_shared_block) + b->block_size);
+ INIT_LIST_HEAD(&cloop_shared_lru);
+ cloop_shared_count = 0;
+ cloop_free(cloop_shared_hash, (cloop_shared_hash_mask + 1) * sizeof(struct hlist_head));
+ cloop_shared_hash = NULL;
+ crypto_free_shash(cloop_shared_sha256);
+ cloop_shared_sha256 = NULL;
+}
+
+static int uncompress_zlib(struct cloop_worker *w,
+                           unsigned char *dest, unsigned long *destLen,
+                           unsigned char *source, unsigned long sourceLen)
 {
  /* Most of this code can be found in fs/cramfs/uncompress.c */
  int err;
- clo->zstream.next_in = source;
- clo->zstream.avail_in = sourceLen;
- clo->zstream.next_out = dest;
- clo->zstream.avail_out = *destLen;
- err = zlib_inflateReset(&clo->zstream);
+ w->zstream.next_in = source;
+ w->zstream.avail_in = sourceLen;
+ w->zstream.next_out = dest;
+ w->zstream.avail_out = *destLen;
+ err = zlib_inflateReset(&w->zstream);
  if (err != Z_OK)
   {
    printk(KERN_ERR "%s: zlib_inflateReset error %d\n", cloop_name, err);
-   zlib_inflateEnd(&clo->zstream); zlib_inflateInit(&clo->zstream);
+   zlib_inflateEnd(&w->zstream); zlib_inflateInit(&w->zstream);
   }
- err = zlib_inflate(&clo->zstream, Z_FINISH);
- *destLen = clo->zstream.total_out;
+ err = zlib_inflate(&w->zstream, Z_FINISH);
+ *destLen = w->zstream.total_out;
  if (err != Z_STREAM_END) return err;
  return Z_OK;
 }
 
+#ifdef CLOOP_HAVE_XZ
+static int uncompress_xz(struct cloop_worker *w,
+                         unsigned char *dest, unsigned long *destLen,
+                         unsigned char *source, unsigned long sourceLen)
+{
+ struct xz_buf b;
+ enum xz_ret err;
+ b.in = source; b.in_pos = 0; b.in_size = sourceLen;
+ b.out = dest; b.out_pos = 0; b.out_size = *destLen;
+ xz_dec_reset(w->xz);
+ err = xz_dec_run(w->xz, &b);
+ *destLen = b.out_pos;
+ return (err == XZ_STREAM_END) ? 0 : err;
+}
+#endif
+
+#ifdef CLOOP_HAVE_LZ4
+static int uncompress_lz4(struct cloop_worker *w,
+                          unsigned char *dest, unsigned long *destLen,
+                          unsigned char *source, unsigned long sourceLen)
+{
+ size_t len = *destLen;
+ int err = lz4_decompress_unknownoutputsize(source, sourceLen, dest, &len);
+ *destLen = len;
+ return err;
+}
+#endif
+
+/* Returns 0 on success, or a compressor specific error code */
+static int uncompress(struct cloop_worker *w, int compressor,
+                      unsigned char *dest, unsigned long *destLen,
+                      unsigned char *source, unsigned long sourceLen)
+{
+ switch(compressor)
+  {
+   case CLOOP_COMPRESSOR_ZLIB:
+    return uncompress_zlib(w, dest, destLen, source, sourceLen);
+#ifdef CLOOP_HAVE_XZ
+   case CLOOP_COMPRESSOR_XZ:
+    return uncompress_xz(w, dest, destLen, source, sourceLen);
+#endif
+#ifdef CLOOP_HAVE_LZ4
+   case CLOOP_COMPRESSOR_LZ4:
+    return uncompress_lz4(w, dest, destLen, source, sourceLen);
+#endif
+   case CLOOP_COMPRESSOR_NONE:
+    if(sourceLen > *destLen) return -EINVAL;
+    memcpy(dest, source, sourceLen);
+    *destLen = sourceLen;
+    return 0;
+  }
+ return -EINVAL;
+}
+
+/* Can this kernel uncompress blocks of that compressor? */
+static int cloop_compressor_supported(int compressor)
+{
+ switch(compressor)
+  {
+   case CLOOP_COMPRESSOR_ZLIB:
+   case CLOOP_COMPRESSOR_NONE:
+#ifdef CLOOP_HAVE_XZ
+   case CLOOP_COMPRESSOR_XZ:
+#endif
+#ifdef CLOOP_HAVE_LZ4
+   case CLOOP_COMPRESSOR_LZ4:
+#endif
+    return 1;
+  }
+ return 0;
+}
+
 static ssize_t cloop_read_from_file(struct cloop_device *clo, struct file *f, char *buf,
   loff_t pos, size_t buf_len)
 {
  size_t buf_done=0;
+ ktime_t start = ktime_get();
  while (buf_done < buf_len)
   {
    size_t size = buf_len - buf_done, size_read;
@@ -232,190 +987,1725 @@ static ssize_t cloop_read_from_file(struct cloop_device *clo, struct file *f, ch
     }
    buf_done += size_read;
   }
+ cloop_stat_inc(clo, backing_reads);
+ cloop_stat_add(clo, backing_bytes, buf_done);
+ cloop_stat_latency(clo, read_latency, start);
  return buf_done;
 }
 
-/* This looks more complicated than it is */
-/* Returns number of block buffer to use for this request */
-static int cloop_load_buffer(struct cloop_device *clo, int blocknum)
+/* Can f be read with direct I/O? */
+static int cloop_can_direct_io(struct file *f)
 {
- unsigned int buf_done = 0;
- unsigned long buflen;
- unsigned int buf_length;
- int ret;
- int i;
- if(blocknum > ntohl(clo->head.num_blocks) || blocknum < 0)
+#ifdef IOCB_DIRECT
+ return (f->f_op->read_iter != NULL && f->f_mapping->a_ops != NULL &&
+         f->f_mapping->a_ops->direct_IO != NULL);
+#else
+ return 0;
+#endif
+}
+
+/* Offsets in the index of a segmented image carry the segment number in
+ * their top bits, 0 for the image file itself. Returns the file that holds
+ * pos and sets *offset to the position in it, or NULL without that segment. */
+static struct file *cloop_segment(struct cloop_device *clo, loff_t pos, loff_t *offset)
+{
+ unsigned int n = (u_int64_t) pos >> CLOOP_SEGMENT_SHIFT;
+ *offset = pos & ((1ULL << CLOOP_SEGMENT_SHIFT) - 1);
+ if(n == 0) return clo->backing_file;
+ return (n <= clo->segment_count) ? clo->segment_files[n-1] : NULL;
+}
+
+/* Read len bytes at pos of the backing file into buf with direct I/O, so
+ * they don't stay in the page cache. buf, pos and len must be multiples of
+ * underlying_blksize, a read beyond the end of the file comes back short.
+ * buf must be one of our own buffers, vmalloc()ed or in the kernel's
+ * direct mapping, its pages are looked up from the address. Returns the
+ * number of bytes read or a negative error. */
+static ssize_t cloop_read_direct_io(struct cloop_device *clo, char *buf,
+                                    loff_t pos, size_t len)
+{
+#ifdef IOCB_DIRECT
+ struct file *f = cloop_segment(clo, pos, &pos);
+ struct bio_vec bvec[CLOOP_DIRECT_PAGES];
+ size_t done = 0;
+ ktime_t start = ktime_get();
+ /* Not a kmap()ed page, virt_to_page() doesn't work for that */
+ if(WARN_ON(!is_vmalloc_addr(buf) && !virt_addr_valid(buf))) return -EINVAL;
+ while(done < len)
   {
-   printk(KERN_WARNING "%s: Invalid block number %d requested.\n",
-                       cloop_name, blocknum);
-   return -1;
+   struct kiocb kiocb;
+   struct iov_iter iter;
+   size_t bytes = 0;
+   ssize_t ret;
+   int n;
+   for(n = 0; n < CLOOP_DIRECT_PAGES && done + bytes < len; n++)
+    {
+     char *p = buf + done + bytes;
+     bvec[n].bv_page = is_vmalloc_addr(p) ? vmalloc_to_page(p) : virt_to_page(p);
+     bvec[n].bv_offset = offset_in_page(p);
+     bvec[n].bv_len = MIN(PAGE_SIZE - bvec[n].bv_offset, len - done - bytes);
+     bytes += bvec[n].bv_len;
+    }
+   init_sync_kiocb(&kiocb, f);
+   kiocb.ki_pos = pos + done;
+   kiocb.ki_flags |= IOCB_DIRECT;
+   iov_iter_bvec(&iter, ITER_BVEC | READ, bvec, n, bytes);
+   ret = f->f_op->read_iter(&kiocb, &iter);
+   if(ret < 0)
+    {
+     printk(KERN_ERR "%s: Direct read error %d at pos %Lu in file %s.\n",
+            cloop_name, (int)ret, pos + done, file);
+     return ret;
+    }
+   done += ret;
+   if(ret < bytes) break; /* end of file */
   }
+ cloop_stat_inc(clo, backing_reads);
+ cloop_stat_add(clo, backing_bytes, done);
+ cloop_stat_latency(clo, read_latency, start);
+ return done;
+#else
+ return -EINVAL;
+#endif
+}
 
- /* Quick return if the block we seek is already in one of the buffers. */
- /* Return number of buffer */
- for(i=0; i<BUFFERED_BLOCKS; i++)
-  if (blocknum == clo->buffered_blocknum[i])
-   {
-    DEBUGP(KERN_INFO "cloop_load_buffer: Found buffered block %d\n", i);
-    return i;
-   }
+/* Read len bytes of compressed data at pos into the worker's buffer.
+ * Returns a pointer to them, or NULL on error. With direct_io, the whole
+ * underlying blocks around them are read. */
+static char *cloop_read_compressed(struct cloop_worker *w, loff_t pos, size_t len)
+{
+ struct cloop_device *clo = w->clo;
+ char *buf = w->compressed_buffer;
+ struct file *f;
+ if(len == 0) return buf;
+ if(clo->direct_io)
+  {
+   size_t head = pos & (clo->underlying_blksize - 1);
+   ssize_t ret = cloop_read_direct_io(clo, buf, pos - head,
+                                      ALIGN(head + len, clo->underlying_blksize));
+   if(ret >= 0 && ret < head + len)
+    printk(KERN_ERR "%s: Direct read of %lu bytes at pos %Lu in file %s came back short.\n",
+           cloop_name, (unsigned long) len, pos, file);
+   return (ret >= 0 && ret >= head + len) ? buf + head : NULL;
+  }
+ f = cloop_segment(clo, pos, &pos);
+ return (cloop_read_from_file(clo, f, buf, pos, len) == len) ? buf : NULL;
+}
+
+/* The compressor of a block, from the codec map if the image has one */
+static inline int cloop_block_compressor(struct cloop_device *clo, int blocknum)
+{
+ return clo->codec_map ? clo->codec_map[blocknum] : clo->compressor;
+}
 
- buf_length = be64_to_cpu(clo->offsets[blocknum+1]) - be64_to_cpu(clo->offsets[blocknum]);
+/* Find index entry n in the index cache, returns a pointer to it or NULL */
+/* if its page is not cached. Must be called with index_lock held. */
+static char *cloop_index_lookup(struct cloop_device *clo, unsigned int n)
+{
+ struct cloop_cache_entry *entry =
+  cloop_cache_lookup(&clo->index_cache, n / clo->index_per_page);
+ if(entry == NULL) return NULL;
+ clo->index_cache.hits++;
+ list_move(&entry->lru, &clo->index_cache.lru);
+ return entry->data + (n % clo->index_per_page) * clo->index_entry_size;
+}
 
-/* Load one compressed block from the file. */
- cloop_read_from_file(clo, clo->backing_file, (char *)clo->compressed_buffer,
-                    be64_to_cpu(clo->offsets[blocknum]), buf_length);
+/* Look up index entry n, reading its page from the file if it is not
+ * cached. The least recently used page is dropped for it. Returns a pointer
+ * to the entry with index_lock held, which the caller drops when done with
+ * it, or NULL on error. May sleep. */
+static char *cloop_index_get(struct cloop_device *clo, unsigned int n)
+{
+ unsigned int page = n / clo->index_per_page;
+ size_t page_bytes = clo->index_per_page * clo->index_entry_size, len;
+ loff_t page_pos = (loff_t) page * page_bytes;
+ struct cloop_cache_entry *victim;
+ char *data;
+ spin_lock(&clo->index_lock);
+ if((data = cloop_index_lookup(clo, n)) != NULL) return data;
+ spin_unlock(&clo->index_lock);
+ mutex_lock(&clo->index_mutex);
+ /* Another worker may have loaded it while we waited */
+ spin_lock(&clo->index_lock);
+ if((data = cloop_index_lookup(clo, n)) != NULL) goto out;
+ spin_unlock(&clo->index_lock);
+ if(clo->backing_file == NULL) goto out; /* suspended */
+ len = MIN(page_bytes, clo->index_size - page_pos);
+ if(cloop_read_from_file(clo, clo->backing_file, clo->index_spare,
+                         clo->index_start + page_pos, len) != len)
+  {
+   printk(KERN_ERR "%s: can't read index page %u.\n", cloop_name, page);
+   goto out;
+  }
+ spin_lock(&clo->index_lock);
+ victim = list_entry(clo->index_cache.lru.prev, struct cloop_cache_entry, lru);
+ if(victim->state != CLOOP_BLOCK_EMPTY)
+  {
+   hlist_del_init(&victim->hash);
+   clo->index_cache.evictions++;
+  }
+ clo->index_cache.misses++;
+ /* Swap buffers, the victim's old page is the next spare */
+ data = victim->data;
+ victim->data = clo->index_spare;
+ clo->index_spare = data;
+ victim->blocknum = page;
+ victim->state = CLOOP_BLOCK_VALID;
+ hlist_add_head(&victim->hash, &clo->index_cache.hash[page & clo->index_cache.hash_mask]);
+ list_move(&victim->lru, &clo->index_cache.lru);
+ data = victim->data + (n % clo->index_per_page) * clo->index_entry_size;
+out:
+ mutex_unlock(&clo->index_mutex);
+ return data;
+}
+
+/* Length i of a compact index group, lengths points behind its offset */
+static inline u_int32_t cloop_group_length(struct cloop_device *clo, const char *lengths,
+                                           unsigned int i)
+{
+ return (clo->index_length_size == sizeof(u_int16_t)) ?
+        get_unaligned_le16(lengths + i * sizeof(u_int16_t)) :
+        get_unaligned_le32(lengths + i * sizeof(u_int32_t));
+}
+
+/* Get position and size of the compressed data of a block in the file.
+ * May sleep to load the index. Returns 0 on success, -EIO on error. */
+static int cloop_block_extent(struct cloop_device *clo, int blocknum,
+                              loff_t *pos, u_int32_t *length)
+{
+ char *entry;
+ unsigned int segment;
+ loff_t offset;
+ if(clo->index_group)
+  { /* Compact index: the group's base offset, then the lengths of its blocks.
+     * Blocks are mostly looked up in order, so the lengths are summed from
+     * the last lookup if it was in front of blocknum in the same group. */
+   unsigned int i = 0, n = blocknum % clo->index_group;
+   if((entry = cloop_index_get(clo, blocknum / clo->index_group)) == NULL) return -EIO;
+   *pos = get_unaligned_le64(entry);
+   entry += sizeof(u_int64_t);
+   if(clo->index_last >= 0 && clo->index_last <= blocknum &&
+      clo->index_last / clo->index_group == blocknum / clo->index_group)
+    {
+     i = clo->index_last % clo->index_group;
+     *pos = clo->index_last_pos;
+    }
+   for(; i < n; i++) *pos += cloop_group_length(clo, entry, i);
+   *length = cloop_group_length(clo, entry, n);
+   clo->index_last = blocknum;
+   clo->index_last_pos = *pos;
+   spin_unlock(&clo->index_lock);
+  }
+ else if(clo->index_entry_size == sizeof(struct cloop_extent))
+  {
+   struct cloop_extent *extent;
+   if((extent = (struct cloop_extent *) cloop_index_get(clo, blocknum)) == NULL) return -EIO;
+   *pos = be64_to_cpu(extent->offset);
+   *length = ntohl(extent->length);
+   spin_unlock(&clo->index_lock);
+  }
+ else
+  {
+   u_int64_t end;
+   if((entry = cloop_index_get(clo, blocknum)) == NULL) return -EIO;
+   *pos = be64_to_cpu(*(u_int64_t *) entry);
+   spin_unlock(&clo->index_lock);
+   if((entry = cloop_index_get(clo, blocknum + 1)) == NULL) return -EIO;
+   end = be64_to_cpu(*(u_int64_t *) entry);
+   spin_unlock(&clo->index_lock);
+   *length = (end >= *pos) ? end - *pos : ~0U;
+  }
+ /* The index is not checked at mount time, so do it here */
+ segment = (u_int64_t) *pos >> CLOOP_SEGMENT_SHIFT;
+ if(*length > clo->largest_block || segment > clo->segment_count ||
+    (segment == 0 && !clo->isblkdev && clo->backing_inode &&
+     *pos + *length > clo->backing_inode->i_size) ||
+    (segment > 0 && cloop_segment(clo, *pos, &offset) &&
+     offset + *length > i_size_read(file_inode(clo->segment_files[segment-1]))))
+  {
+   printk(KERN_ERR "%s: bad offset %Lu or length %u of block %d.\n",
+          cloop_name, *pos, *length, blocknum);
+   return -EIO;
+  }
+ return 0;
+}
+
+/* Returns a pointer to the length bytes of compressed data at pos in the
+ * file if they are preloaded (preload_compressed), else NULL. */
+static char *cloop_preloaded_data(struct cloop_device *clo, loff_t pos, u_int32_t length)
+{
+ size_t offset, i;
+ if(!clo->preload_compressed || clo->preload_map == NULL || length == 0 ||
+    pos < clo->preload_pos || pos + length > clo->preload_pos + clo->preload_bytes)
+  return NULL;
+ offset = pos - clo->preload_pos;
+ for(i = offset / CLOOP_PRELOAD_CHUNK; i <= (offset + length - 1) / CLOOP_PRELOAD_CHUNK; i++)
+  if(!test_bit(i, clo->preload_map)) return NULL;
+ smp_rmb(); /* read data only after seeing the bits */
+ return clo->preload_data + offset;
+}
+
+/* Uncompress block blocknum from its buf_length bytes of compressed data at source */
+static int cloop_uncompress_block(struct cloop_worker *w, int blocknum, char *dest,
+                                  char *source, unsigned int buf_length)
+{
+ struct cloop_device *clo = w->clo;
+ int compressor = cloop_block_compressor(clo, blocknum);
+ unsigned int buf_done = 0;
+ unsigned long buflen;
+ ktime_t start;
+ int ret;
 
  buflen = ntohl(clo->head.block_size);
 
- /* Go to next position in the block ring buffer */
- clo->current_bufnum++;
- if(clo->current_bufnum >= BUFFERED_BLOCKS) clo->current_bufnum = 0;
+ /* Blocks of zeroes are not stored at all */
+ if (buf_length == 0)
+  {
+   memset(dest, 0, buflen);
+   return 0;
+  }
 
  /* Do the uncompression */
- ret = uncompress(clo, clo->buffer[clo->current_bufnum], &buflen, clo->compressed_buffer,
-                  buf_length);
+ trace_cloop_decompress_start(clo->clo_number, blocknum, compressor, buf_length);
+ start = ktime_get();
+ ret = uncompress(w, compressor, dest, &buflen, source, buf_length);
+ trace_cloop_decompress_done(clo->clo_number, blocknum, ret, buflen);
+ cloop_stat_inc(clo, uncompressed_blocks);
+ cloop_stat_latency(clo, inflate_latency, start);
  /* DEBUGP("cloop: buflen after uncompress: %ld\n",buflen); */
  if (ret != 0)
   {
-   printk(KERN_ERR "%s: zlib decompression error %i uncompressing block %u %u/%lu/%u/%u "
-          "%Lu-%Lu\n", cloop_name, ret, blocknum,
-	  ntohl(clo->head.block_size), buflen, buf_length, buf_done,
-	  be64_to_cpu(clo->offsets[blocknum]), be64_to_cpu(clo->offsets[blocknum+1]));
-   clo->buffered_blocknum[clo->current_bufnum] = -1;
+   printk(KERN_ERR "%s: %s decompression error %i uncompressing block %u %u/%lu/%u/%u\n",
+          cloop_name, cloop_compressor_names[compressor], ret, blocknum,
+	  ntohl(clo->head.block_size), buflen, buf_length, buf_done);
    return -1;
   }
- clo->buffered_blocknum[clo->current_bufnum] = blocknum;
- return clo->current_bufnum;
+ cloop_shared_add(clo, blocknum, dest);
+ return 0;
 }
 
-/* This function does all the real work. */
-/* returns "uptodate" */
-static int cloop_handle_request(struct cloop_device *clo, struct request *req)
+/* The workers fill the preload cache in the background, a block counts
+ * only once its data is complete. Blocks that are preloaded compressed are
+ * uncompressed into the cache like the others. */
+static int cloop_is_preloaded(struct cloop_device *clo, int blocknum)
 {
- int buffered_blocknum = -1;
- int preloaded = 0;
- loff_t offset     = (loff_t) blk_rq_pos(req)<<9; /* req->sector<<9 */
- struct bio_vec bvec;
- struct req_iterator iter;
- rq_for_each_segment(bvec, req, iter)
+ if(clo->preload_compressed || blocknum >= clo->preload_size || clo->preload_map == NULL ||
+    !test_bit(blocknum, clo->preload_map)) return 0;
+ smp_rmb(); /* read data only after seeing the bit */
+ return 1;
+}
+
+/* Look up blocknum in the cache and take a reference to it. On a miss, the
+ * least recently used unreferenced entry is reserved for blocknum and queued
+ * on the fetch_list of class prio for the workers, a waiting entry is moved
+ * there if prio comes first. Returns NULL if all entries are in use. */
+/* Must be called with cache_lock held. */
+static struct cloop_cache_entry *cloop_cache_get(struct cloop_device *clo, int blocknum,
+                                                 int prio)
+{
+ struct cloop_cache_entry *entry = cloop_cache_lookup(&clo->cache, blocknum);
+ if(entry)
   {
-   unsigned long len = bvec.bv_len;
-   char *to_ptr      = kmap(bvec.bv_page) + bvec.bv_offset;
-   while(len > 0)
+   DEBUGP(KERN_INFO "cloop_cache_get: Found buffered block %d\n", blocknum);
+   trace_cloop_cache_hit(clo->clo_number, blocknum);
+   clo->cache.hits++;
+   if(!list_empty(&entry->fetch) && prio < entry->prio)
     {
-     u_int32_t length_in_buffer;
-     loff_t block_offset = offset;
+     list_move_tail(&entry->fetch, &clo->fetch_list[prio]);
+     entry->prio = prio;
+    }
+  }
+ else
+  {
+   struct cloop_cache_entry *victim = NULL;
+   trace_cloop_cache_miss(clo->clo_number, blocknum);
+   clo->cache.misses++;
+   list_for_each_entry_reverse(entry, &clo->cache.lru, lru)
+    if(entry->refcnt == 0 && entry->state != CLOOP_BLOCK_LOADING && entry->data)
+     { victim = entry; break; }
+   if(victim == NULL) return NULL;
+   entry = victim;
+   if(entry->state != CLOOP_BLOCK_EMPTY)
+    {
+     hlist_del_init(&entry->hash);
+     clo->cache.evictions++;
+    }
+   entry->blocknum = blocknum;
+   entry->state = CLOOP_BLOCK_LOADING;
+   hlist_add_head(&entry->hash, &clo->cache.hash[blocknum & clo->cache.hash_mask]);
+   list_add_tail(&entry->fetch, &clo->fetch_list[prio]);
+   entry->prio = prio;
+  }
+ entry->refcnt++;
+ list_move(&entry->lru, &clo->cache.lru);
+ return entry;
+}
+
+/* Don't keep failed blocks that nobody references, the next request
+ * tries again. */
+/* Must be called with cache_lock held. */
+static void cloop_cache_forget(struct cloop_device *clo, struct cloop_cache_entry *entry)
+{
+ if(entry->refcnt > 0 || entry->state != CLOOP_BLOCK_ERROR) return;
+ hlist_del_init(&entry->hash);
+ entry->blocknum = -1;
+ entry->state = CLOOP_BLOCK_EMPTY;
+ list_move_tail(&entry->lru, &clo->cache.lru);
+}
+
+/* Drop a reference taken by cloop_cache_get(). */
+/* Must be called with cache_lock held. */
+static void cloop_cache_put(struct cloop_device *clo, struct cloop_cache_entry *entry)
+{
+ if(--entry->refcnt > 0) return;
+ /* Nobody wants it any more, don't load it. An entry that a worker is
+  * loading stays until it is done. */
+ if(entry->state == CLOOP_BLOCK_LOADING && !list_empty(&entry->fetch))
+  {
+   list_del_init(&entry->fetch);
+   entry->state = CLOOP_BLOCK_ERROR;
+  }
+ cloop_cache_forget(clo, entry);
+}
+
+/* A worker is done loading entry, ret is 0 if its data is valid. The last
+ * reference may have been dropped meanwhile. */
+/* Must be called with cache_lock held. */
+static void cloop_cache_loaded(struct cloop_device *clo, struct cloop_cache_entry *entry, int ret)
+{
+ entry->state = (ret == 0) ? CLOOP_BLOCK_VALID : CLOOP_BLOCK_ERROR;
+ cloop_cache_forget(clo, entry);
+}
+
+/* Blocks of a delta image that did not change are taken from its base
+ * image. Returns the block number in the base image, or -1. */
+static inline int cloop_base_block(struct cloop_device *clo, int blocknum)
+{
+ return clo->base_map ? (int) ntohl(clo->base_map[blocknum]) - 1 : -1;
+}
+
+/* Reference block blocknum in the cache, NULL if all entries are in use.
+ * A delta worker waits for it, so it is a demand read of the base. */
+static struct cloop_cache_entry *cloop_base_get(struct cloop_device *base, int blocknum)
+{
+ struct cloop_cache_entry *entry;
+ spin_lock(&base->cache_lock);
+ entry = cloop_cache_get(base, blocknum, CLOOP_PRIO_DEMAND);
+ spin_unlock(&base->cache_lock);
+ return entry;
+}
+
+static int cloop_load_base(struct cloop_device *clo, int blocknum, char *dest);
+
+/* Read and uncompress one block into dest, using the buffers of worker w. */
+/* Returns 0 on success, -1 on error. */
+static int cloop_load_block(struct cloop_worker *w, int blocknum, char *dest)
+{
+ struct cloop_device *clo = w->clo;
+ loff_t pos;
+ u_int32_t length;
+ char *source;
+ if(cloop_shared_get(clo, blocknum, dest)) return 0;
+ if(cloop_base_block(clo, blocknum) >= 0) return cloop_load_base(clo, blocknum, dest);
+ if(cloop_block_extent(clo, blocknum, &pos, &length)) return -1;
+
+ if((source = cloop_preloaded_data(clo, pos, length)) != NULL)
+  {
+   trace_cloop_preload_hit(clo->clo_number, blocknum);
+   cloop_stat_inc(clo, preload_hits);
+   return cloop_uncompress_block(w, blocknum, dest, source, length);
+  }
+
+/* Load one compressed block from the file. */
+ trace_cloop_fetch_start(clo->clo_number, blocknum, 1, pos, length);
+ source = cloop_read_compressed(w, pos, length);
+ trace_cloop_fetch_done(clo->clo_number, blocknum, 1, pos, length);
+ if(source == NULL) return -1;
+
+ return cloop_uncompress_block(w, blocknum, dest, source, length);
+}
+
+/* Load a cache entry that has been taken off fetch_list. Following blocks
+ * that are also waiting on fetch_list are taken along, as long as their
+ * compressed data follows directly and fits into the worker's buffer, and
+ * are read from the backing file in one go. Must be called with cache_lock
+ * held, which is released before reading. */
+static void cloop_fetch_entry(struct cloop_worker *w, struct cloop_cache_entry *entry)
+{
+ struct cloop_device *clo = w->clo;
+ struct cloop_cache_entry *batch[CLOOP_MAX_BATCH];
+ loff_t pos[CLOOP_MAX_BATCH], start, end;
+ u_int32_t length[CLOOP_MAX_BATCH];
+ int i, count = 1, candidates, blocknum = entry->blocknum, found = 1;
+ char *source;
+ batch[0] = entry;
+ spin_unlock(&clo->cache_lock);
+ if(cloop_shared_get(clo, blocknum, entry->data)) found = 0;
+ else if(cloop_base_block(clo, blocknum) >= 0) found = cloop_load_base(clo, blocknum, entry->data);
+ if(found <= 0)
+  {
+   smp_wmb(); /* publish data before the state */
+   spin_lock(&clo->cache_lock);
+   cloop_cache_loaded(clo, entry, found);
+   spin_unlock(&clo->cache_lock);
+   wake_up_all(&clo->cache_event);
+   return;
+  }
+ /* Look up the extents without cache_lock, the index may have to be read.
+  * Shared blocks point back to data stored earlier in the file. */
+ for(candidates = 0; candidates < w->max_batch &&
+     blocknum + candidates < ntohl(clo->head.num_blocks); candidates++)
+  {
+   i = candidates;
+   if(i > 0 && cloop_base_block(clo, blocknum + i) >= 0) break;
+   if(cloop_block_extent(clo, blocknum + i, &pos[i], &length[i])) break;
+   if(i > 0 && (pos[i] != pos[i-1] + length[i-1] ||
+                pos[i] + length[i] - pos[0] > w->compressed_size)) break;
+  }
+ if(candidates == 0)
+  { /* No index entry for the block itself */
+   spin_lock(&clo->cache_lock);
+   cloop_cache_loaded(clo, entry, -1);
+   spin_unlock(&clo->cache_lock);
+   wake_up_all(&clo->cache_event);
+   return;
+  }
+ spin_lock(&clo->cache_lock);
+ while(count < candidates)
+  {
+   struct cloop_cache_entry *next = cloop_cache_lookup(&clo->cache, blocknum + count);
+   if(next == NULL || list_empty(&next->fetch)) break;
+   list_del_init(&next->fetch);
+   batch[count++] = next;
+  }
+ spin_unlock(&clo->cache_lock);
+ start = pos[0];
+ end = pos[count-1] + length[count-1];
+ if((source = cloop_preloaded_data(clo, start, end - start)) != NULL)
+  {
+   trace_cloop_preload_hit(clo->clo_number, blocknum);
+   cloop_stat_add(clo, preload_hits, count);
+  }
+ else
+  {
+   trace_cloop_fetch_start(clo->clo_number, blocknum, count, start, end - start);
+   source = cloop_read_compressed(w, start, end - start);
+   trace_cloop_fetch_done(clo->clo_number, blocknum, count, start, end - start);
+  }
+ for(i=0; i<count; i++)
+  {
+   int ret = (source == NULL) ? -1 :
+             cloop_uncompress_block(w, blocknum + i, batch[i]->data,
+                                    source + (pos[i] - start), length[i]);
+   smp_wmb(); /* publish data before the state */
+   spin_lock(&clo->cache_lock);
+   cloop_cache_loaded(clo, batch[i], ret);
+   spin_unlock(&clo->cache_lock);
+   wake_up_all(&clo->cache_event);
+  }
+}
+
+/* Load one entry from the fetch_list of class prio, returns 0 if there was
+ * nothing to do. */
+static int cloop_fetch_one(struct cloop_worker *w, int prio)
+{
+ struct cloop_device *clo = w->clo;
+ struct cloop_cache_entry *entry = NULL;
+ if(list_empty(&clo->fetch_list[prio])) return 0; /* unlocked peek */
+ spin_lock(&clo->cache_lock);
+ if(!list_empty(&clo->fetch_list[prio]))
+  {
+   entry = list_first_entry(&clo->fetch_list[prio], struct cloop_cache_entry, fetch);
+   list_del_init(&entry->fetch);
+  }
+ if(entry == NULL)
+  {
+   spin_unlock(&clo->cache_lock);
+   return 0;
+  }
+ w->prio = prio;
+ cloop_fetch_entry(w, entry);
+ return 1;
+}
+
+/* Wait until a referenced cache entry has been loaded. If no other worker
+ * has picked it up yet, load it ourselves. Returns 0 if data is valid. */
+static int cloop_cache_wait(struct cloop_worker *w, struct cloop_cache_entry *entry)
+{
+ struct cloop_device *clo = w->clo;
+ int state;
+ spin_lock(&clo->cache_lock);
+ if(!list_empty(&entry->fetch))
+  {
+   list_del_init(&entry->fetch);
+   cloop_fetch_entry(w, entry);
+  }
+ else
+  spin_unlock(&clo->cache_lock);
+ wait_event(clo->cache_event,
+            (state = ACCESS_ONCE(entry->state)) != CLOOP_BLOCK_LOADING);
+ smp_rmb(); /* read data only after seeing the state */
+ return (state == CLOOP_BLOCK_VALID) ? 0 : -1;
+}
+
+/* Copy block blocknum of a delta image from its base image to dest, through
+ * the cache of the base device, so deltas of one base share it. Blocks that
+ * no worker of the base has taken up yet are loaded here, with base_worker:
+ * the workers of the base may be waiting behind a writer of its
+ * clo_cache_rwsem, who waits for us. Returns 0 on success, -1 on error. */
+static int cloop_load_base(struct cloop_device *clo, int blocknum, char *dest)
+{
+ struct cloop_device *base = clo->base;
+ struct cloop_cache_entry *entry;
+ u_int32_t block_size = ntohl(base->head.block_size);
+ int n = cloop_base_block(clo, blocknum), state;
+ cloop_stat_inc(clo, base_blocks);
+ down_read(&base->clo_cache_rwsem);
+ if(cloop_is_preloaded(base, n))
+  {
+   memcpy(dest, base->preload_data + (size_t) n * block_size, block_size);
+   up_read(&base->clo_cache_rwsem);
+   return 0;
+  }
+ if((entry = cloop_base_get(base, n)) == NULL)
+  { /* All cache entries of the base are in use, bypass its cache. */
+   mutex_lock(&clo->base_mutex);
+   state = cloop_load_block(&clo->base_worker, n, dest);
+   mutex_unlock(&clo->base_mutex);
+   up_read(&base->clo_cache_rwsem);
+   return state;
+  }
+ if(ACCESS_ONCE(entry->state) == CLOOP_BLOCK_LOADING)
+  {
+   mutex_lock(&clo->base_mutex);
+   spin_lock(&base->cache_lock);
+   if(!list_empty(&entry->fetch))
+    {
+     list_del_init(&entry->fetch);
+     cloop_fetch_entry(&clo->base_worker, entry);
+    }
+   else
+    spin_unlock(&base->cache_lock);
+   mutex_unlock(&clo->base_mutex);
+  }
+ /* A worker of the base that has taken it up holds clo_cache_rwsem */
+ wait_event(base->cache_event,
+            (state = ACCESS_ONCE(entry->state)) != CLOOP_BLOCK_LOADING);
+ smp_rmb(); /* read data only after seeing the state */
+ if(state == CLOOP_BLOCK_VALID) memcpy(dest, entry->data, block_size);
+ spin_lock(&base->cache_lock);
+ cloop_cache_put(base, entry);
+ spin_unlock(&base->cache_lock);
+ up_read(&base->clo_cache_rwsem);
+ return (state == CLOOP_BLOCK_VALID) ? 0 : -1;
+}
+
+/* Blocks that are stored uncompressed and not preloaded are read straight
+ * into the request's pages, bypassing the cache. Blocks of zeroes are not
+ * known before their index page is read, they go through the cache. */
+static int cloop_is_direct(struct cloop_device *clo, int blocknum)
+{
+ return (cloop_block_compressor(clo, blocknum) == CLOOP_COMPRESSOR_NONE &&
+         cloop_base_block(clo, blocknum) < 0 && !cloop_is_preloaded(clo, blocknum));
+}
+
+/* Copy len bytes at offset_in_block of stored block blocknum to dest */
+static int cloop_read_direct(struct cloop_worker *w, int blocknum,
+                             u_int32_t offset_in_block, char *dest, u_int32_t len)
+{
+ struct cloop_device *clo = w->clo;
+ loff_t pos, offset;
+ u_int32_t length;
+ char *source;
+ if(cloop_block_extent(clo, blocknum, &pos, &length)) return -1;
+ if(length == 0)
+  {
+   memset(dest, 0, len);
+   return 0;
+  }
+ if(offset_in_block + len > length)
+  {
+   printk(KERN_ERR "%s: stored block %d is too short.\n", cloop_name, blocknum);
+   return -1;
+  }
+ if((source = cloop_preloaded_data(clo, pos, length)) != NULL)
+  {
+   memcpy(dest, source + offset_in_block, len);
+   return 0;
+  }
+ trace_cloop_fetch_start(clo->clo_number, blocknum, 1, pos + offset_in_block, len);
+ if(clo->direct_io)
+  { /* dest need not be aligned */
+   if((source = cloop_read_compressed(w, pos + offset_in_block, len)) == NULL) return -1;
+   memcpy(dest, source, len);
+  }
+ else
+  {
+   struct file *f = cloop_segment(clo, pos + offset_in_block, &offset);
+   if(cloop_read_from_file(clo, f, dest, offset, len) != len) return -1;
+  }
+ trace_cloop_fetch_done(clo->clo_number, blocknum, 1, pos + offset_in_block, len);
+ return 0;
+}
+
+/* zlib takes its output in pieces, so whole zlib blocks of a request can be
+ * uncompressed straight into its pages. The other decompressors need the
+ * whole block in one buffer. Reads the compressed data of blocknum and sets
+ * up the worker's zlib stream for cloop_inflate_next(). Returns the
+ * compressed length, 0 for a block of zeroes, or -1 on error. */
+static int cloop_inflate_start(struct cloop_worker *w, int blocknum)
+{
+ struct cloop_device *clo = w->clo;
+ loff_t pos;
+ u_int32_t length;
+ char *source;
+ int err;
+ if(cloop_block_extent(clo, blocknum, &pos, &length)) return -1;
+ if(length == 0) return 0;
+ if((source = cloop_preloaded_data(clo, pos, length)) != NULL)
+  {
+   trace_cloop_preload_hit(clo->clo_number, blocknum);
+   cloop_stat_inc(clo, preload_hits);
+  }
+ else
+  {
+   trace_cloop_fetch_start(clo->clo_number, blocknum, 1, pos, length);
+   if((source = cloop_read_compressed(w, pos, length)) == NULL) return -1;
+   trace_cloop_fetch_done(clo->clo_number, blocknum, 1, pos, length);
+  }
+ trace_cloop_decompress_start(clo->clo_number, blocknum, CLOOP_COMPRESSOR_ZLIB, length);
+ w->zstream.next_in = source;
+ w->zstream.avail_in = length;
+ w->inflate_start = ktime_get();
+ err = zlib_inflateReset(&w->zstream);
+ if (err != Z_OK)
+  {
+   printk(KERN_ERR "%s: zlib_inflateReset error %d\n", cloop_name, err);
+   zlib_inflateEnd(&w->zstream); zlib_inflateInit(&w->zstream);
+  }
+ return length;
+}
+
+/* Uncompress the next len bytes of the block set up by cloop_inflate_start()
+ * to dest, "last" tells that they are the end of the block. */
+static int cloop_inflate_next(struct cloop_worker *w, int blocknum, char *dest,
+                              u_int32_t len, int last)
+{
+ int err;
+ w->zstream.next_out = dest;
+ w->zstream.avail_out = len;
+ err = zlib_inflate(&w->zstream, last ? Z_FINISH : Z_SYNC_FLUSH);
+ /* The last block of an image may be short, the rest of it is zero */
+ if(err == Z_STREAM_END && w->zstream.avail_out > 0)
+  {
+   memset(w->zstream.next_out, 0, w->zstream.avail_out);
+   w->zstream.avail_out = 0;
+  }
+ if(w->zstream.avail_out == 0 && (err == Z_STREAM_END || (err == Z_OK && !last)))
+  {
+   if(last)
+    {
+     trace_cloop_decompress_done(w->clo->clo_number, blocknum, 0, w->zstream.total_out);
+     cloop_stat_inc(w->clo, uncompressed_blocks);
+     cloop_stat_inc(w->clo, inflated_blocks);
+     cloop_stat_latency(w->clo, inflate_latency, w->inflate_start);
+    }
+   return 0;
+  }
+ trace_cloop_decompress_done(w->clo->clo_number, blocknum, err, w->zstream.total_out);
+ printk(KERN_ERR "%s: zlib decompression error %d uncompressing block %d at %lu\n",
+        cloop_name, err, blocknum, w->zstream.total_out);
+ return -1;
+}
+
+/* Start reading the pages of f from pos to end into the page cache */
+static void cloop_readahead_range(struct file *f, loff_t pos, loff_t end)
+{
+ pgoff_t start = pos >> PAGE_CACHE_SHIFT;
+ pgoff_t stop = (end + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+ if(stop > start)
+  page_cache_sync_readahead(f->f_mapping, &f->f_ra, f, start, stop - start);
+}
+
+/* Runs of data followed at once by cloop_readahead_segments() */
+#define CLOOP_READAHEAD_RUNS 8
+
+/* The blocks of a segmented image are spread over its segments. Their
+ * data is read ahead in runs that follow each other in a segment, which
+ * starts reading the segments in parallel. */
+static void cloop_readahead_segments(struct cloop_device *clo, int first, int last)
+{
+ struct { loff_t start, end; } run[CLOOP_READAHEAD_RUNS];
+ int i, n, runs = 0, next = 0;
+ loff_t pos, offset;
+ u_int32_t length;
+ struct file *f;
+ for(i = first; i <= last; i++)
+  {
+   if(cloop_is_preloaded(clo, i) || cloop_base_block(clo, i) >= 0) continue;
+   if(cloop_block_extent(clo, i, &pos, &length)) break;
+   if(length == 0) continue;
+   /* The segment is in the top bits, so runs don't cross segments */
+   for(n = 0; n < runs && run[n].end != pos; n++);
+   if(n < runs) { run[n].end += length; continue; }
+   if(runs < CLOOP_READAHEAD_RUNS) n = runs++;
+   else
+    { /* Start the oldest run to make room */
+     n = next;
+     next = (next + 1) % CLOOP_READAHEAD_RUNS;
+     if((f = cloop_segment(clo, run[n].start, &offset)) != NULL)
+      cloop_readahead_range(f, offset, offset + run[n].end - run[n].start);
+    }
+   run[n].start = pos;
+   run[n].end = pos + length;
+  }
+ for(n = 0; n < runs; n++)
+  if((f = cloop_segment(clo, run[n].start, &offset)) != NULL)
+   cloop_readahead_range(f, offset, offset + run[n].end - run[n].start);
+}
+
+/* Start reading the compressed data of blocks first..last, and of the
+ * readahead window behind them, into the page cache. This does not wait
+ * for the I/O, so the storage works on the next blocks while the workers
+ * uncompress the current ones. */
+static void cloop_readahead(struct cloop_device *clo, int first, int last)
+{
+ struct file *f = clo->backing_file;
+ unsigned long num_blocks = ntohl(clo->head.num_blocks);
+ loff_t first_pos, last_pos;
+ u_int32_t first_length, last_length;
+ if(f == NULL || clo->direct_io) return; /* keep the page cache out of it */
+ last = MIN((unsigned long) last + ACCESS_ONCE(readahead), num_blocks - 1);
+ while(first <= last && cloop_is_preloaded(clo, first)) first++;
+ if(first > last) return;
+ if(clo->segment_count)
+  {
+   cloop_readahead_segments(clo, first, last);
+   return;
+  }
+ if(cloop_block_extent(clo, first, &first_pos, &first_length) ||
+    cloop_block_extent(clo, last, &last_pos, &last_length)) return;
+ if(cloop_preloaded_data(clo, first_pos, last_pos + last_length - first_pos)) return;
+ cloop_readahead_range(f, first_pos, last_pos + last_length);
+}
+
+/* This looks more complicated than it is */
+/* Returns pointer to the uncompressed data of blocknum, NULL on error.
+ * If the data is in the cache, *pentry is set to the cache entry, and the
+ * reference to it must be dropped with cloop_cache_put() after use.
+ * "referenced" tells that the caller already holds that reference, the
+ * block is then taken from the cache even if it was preloaded meanwhile. */
+static char *cloop_load_buffer(struct cloop_worker *w, int blocknum,
+                               int referenced, struct cloop_cache_entry **pentry)
+{
+ struct cloop_device *clo = w->clo;
+ struct cloop_cache_entry *entry;
+ *pentry = NULL;
+ if(blocknum >= ntohl(clo->head.num_blocks) || blocknum < 0)
+  {
+   printk(KERN_WARNING "%s: Invalid block number %d requested.\n",
+                       cloop_name, blocknum);
+   return NULL;
+  }
+ /* Lookup preload cache */
+ if(!referenced && cloop_is_preloaded(clo, blocknum))
+  {
+   trace_cloop_preload_hit(clo->clo_number, blocknum);
+   cloop_stat_inc(clo, preload_hits);
+   return clo->preload_data + (size_t) blocknum * ntohl(clo->head.block_size);
+  }
+ spin_lock(&clo->cache_lock);
+ if(referenced) entry = cloop_cache_lookup(&clo->cache, blocknum);
+ else           entry = cloop_cache_get(clo, blocknum, w->prio);
+ spin_unlock(&clo->cache_lock);
+ if(entry == NULL)
+  { /* All cache entries are in use, bypass the cache. */
+   return (cloop_load_block(w, blocknum, w->buffer) == 0) ? w->buffer : NULL;
+  }
+ *pentry = entry;
+ return (cloop_cache_wait(w, entry) == 0) ? entry->data : NULL;
+}
+
+static void cloop_release_buffer(struct cloop_device *clo, struct cloop_cache_entry *entry)
+{
+ if(entry == NULL) return;
+ spin_lock(&clo->cache_lock);
+ cloop_cache_put(clo, entry);
+ spin_unlock(&clo->cache_lock);
+}
+
+/* Note blocknum in the record if it is read for the first time. Workers
+ * don't wait for each other, each takes the next slot. */
+static void cloop_record_block(struct cloop_device *clo, int blocknum)
+{
+ unsigned int n;
+ if(clo->record == NULL || blocknum >= ntohl(clo->head.num_blocks) ||
+    test_and_set_bit(blocknum, clo->record_map)) return;
+ n = atomic_inc_return(&clo->record_count) - 1;
+ if(n < clo->record_size) clo->record[n] = blocknum;
+}
+
+/* Wake up to n other workers, so they help loading blocks from fetch_list.
+ * Those on the same NUMA node come first, the data is copied here. */
+static void cloop_wake_helpers(struct cloop_worker *w, int n)
+{
+ struct cloop_device *clo = w->clo;
+ int i, pass;
+ for(pass = 0; pass < 2 && n > 0; pass++)
+  for(i = 1; i < clo->num_workers && n > 0; i++)
+   {
+    struct cloop_worker *h = &clo->workers[(w->number + i) % clo->num_workers];
+    if((h->node == w->node) != (pass == 0)) continue;
+    wake_up(&h->clo_event);
+    n--;
+   }
+}
+
+/* cloop_handle_request() decides how to get the first CLOOP_REQUEST_BLOCKS
+ * blocks of a request before it starts copying, and keeps the decisions in
+ * bitmaps. They must not change later, for instance when a block has been
+ * preloaded in the meantime. */
+#define CLOOP_REQUEST_BLOCKS 128
+
+static inline int cloop_request_bit(int blocknum, int first_block, const unsigned long *map)
+{
+ return (blocknum >= first_block && blocknum - first_block < CLOOP_REQUEST_BLOCKS &&
+         test_bit(blocknum - first_block, map));
+}
+
+/* Reference the blocks of a request from *end on, so idle workers can load
+ * them in parallel while we copy. Stop at a block that does not fit into
+ * the cache, after CLOOP_REQUEST_BLOCKS, or when *pinned cache entries, half
+ * of the cache, are referenced, so one large request leaves the rest to the
+ * others. Whole zlib blocks that are not cached skip the cache and are
+ * uncompressed into the request's pages, so they are copied only once,
+ * unless the shared cache may have them. Returns the number of blocks queued
+ * for loading. Must be called with cache_lock held. */
+static int cloop_request_reference(struct cloop_worker *w, int first_block,
+                                   int first_whole, int last_whole, int last_block,
+                                   int *end, unsigned int *pinned,
+                                   unsigned long *cached, unsigned long *inflate)
+{
+ struct cloop_device *clo = w->clo;
+ unsigned int window = MAX(clo->cache.size / 2, 1);
+ int queued = 0;
+ for(; *end <= last_block && *end - first_block < CLOOP_REQUEST_BLOCKS; (*end)++)
+  {
+   struct cloop_cache_entry *entry;
+   int n = *end;
+   if(n >= ntohl(clo->head.num_blocks)) break;
+   if(cloop_is_preloaded(clo, n) || cloop_is_direct(clo, n)) continue;
+   if(n >= first_whole && n <= last_whole &&
+      cloop_block_compressor(clo, n) == CLOOP_COMPRESSOR_ZLIB &&
+      cloop_block_hash(clo, n) == NULL &&
+      cloop_base_block(clo, n) < 0 &&
+      cloop_cache_lookup(&clo->cache, n) == NULL)
+    {
+     __set_bit(n - first_block, inflate);
+     continue;
+    }
+   if(*pinned >= window) break;
+   entry = cloop_cache_get(clo, n, w->prio);
+   if(entry == NULL) break;
+   __set_bit(n - first_block, cached);
+   (*pinned)++;
+   if(!list_empty(&entry->fetch)) queued++;
+  }
+ return queued;
+}
+
+/* Where cloop_handle_request() gets the data of the current block from */
+#define CLOOP_COPY_BUFFER  0 /* the cache, the preload cache or w->buffer */
+#define CLOOP_COPY_STORED  1 /* the file, for blocks stored uncompressed */
+#define CLOOP_COPY_INFLATE 2 /* uncompressed straight into the pages */
+#define CLOOP_COPY_ZERO    3 /* a block of zeroes that is not stored */
+
+/* This function does all the real work. */
+/* returns "uptodate" */
+static int cloop_handle_request(struct cloop_worker *w, struct request *req)
+{
+ struct cloop_device *clo = w->clo;
+ struct cloop_cache_entry *entry = NULL;
+ char *from_ptr = NULL;
+ int uptodate = 1, direct = CLOOP_COPY_BUFFER;
+ int blocknum = -1, first_block, last_block, referenced_end, referenced = 0, queued;
+ int first_whole, last_whole;
+ unsigned int pinned = 0;
+ DECLARE_BITMAP(cached, CLOOP_REQUEST_BLOCKS);  /* bit n: block first_block+n is referenced */
+ DECLARE_BITMAP(inflate, CLOOP_REQUEST_BLOCKS); /* bit n: it goes to the pages */
+ u_int32_t block_size = ntohl(clo->head.block_size);
+ loff_t offset     = (loff_t) blk_rq_pos(req)<<9; /* req->sector<<9 */
+ loff_t first = offset, last = offset + blk_rq_bytes(req) - 1;
+ u_int32_t first_rem, last_rem;
+ struct bio_vec bvec;
+ struct req_iterator iter;
+ first_rem = do_div(first, block_size); first_block = first;
+ last_rem  = do_div(last,  block_size); last_block  = last;
+ /* Blocks that the request covers completely */
+ first_whole = first_rem ? first_block + 1 : first_block;
+ last_whole = (last_rem == block_size - 1) ? last_block : last_block - 1;
+ bitmap_zero(cached, CLOOP_REQUEST_BLOCKS);
+ bitmap_zero(inflate, CLOOP_REQUEST_BLOCKS);
+ cloop_readahead(clo, first_block, last_block);
+ /* Reference the first blocks of the request up front, the window moves on
+  * as they are copied. Blocks that are not referenced when we get to them
+  * are handled by cloop_load_buffer(). */
+ referenced_end = first_block;
+ spin_lock(&clo->cache_lock);
+ queued = cloop_request_reference(w, first_block, first_whole, last_whole, last_block,
+                                  &referenced_end, &pinned, cached, inflate);
+ spin_unlock(&clo->cache_lock);
+ /* The first block is ours, the others may be loaded by idle workers */
+ cloop_wake_helpers(w, queued - 1);
+ rq_for_each_segment(bvec, req, iter)
+  {
+   unsigned long len = bvec.bv_len;
+   char *to_ptr      = kmap(bvec.bv_page) + bvec.bv_offset;
+   while(len > 0)
+    {
+     u_int32_t length_in_buffer;
+     loff_t block_offset = offset;
      u_int32_t offset_in_buffer;
-     char *from_ptr;
      /* do_div (div64.h) returns the 64bit division remainder and  */
      /* puts the result in the first argument, i.e. block_offset   */
      /* becomes the blocknumber to load, and offset_in_buffer the  */
      /* position in the buffer */
-     offset_in_buffer = do_div(block_offset, ntohl(clo->head.block_size));
-     /* Lookup preload cache */
-     if(block_offset < clo->preload_size && clo->preload_cache != NULL &&
-        clo->preload_cache[block_offset] != NULL)
-      { /* Copy from cache */
-       preloaded = 1;
-       from_ptr = clo->preload_cache[block_offset];
-      }
-     else
+     offset_in_buffer = do_div(block_offset, block_size);
+     if(block_offset != blocknum)
       {
-       preloaded = 0;
-       buffered_blocknum = cloop_load_buffer(clo,block_offset);
-       if(buffered_blocknum == -1) break; /* invalid data, leave inner loop */
-       /* Copy from buffer */
-       from_ptr = clo->buffer[buffered_blocknum];
+       cloop_release_buffer(clo, entry);
+       if(referenced) pinned--;
+       entry = NULL;
+       blocknum = block_offset;
+       cloop_record_block(clo, blocknum);
+       /* Blocks that we have passed are not referenced any more */
+       if(referenced_end < blocknum) referenced_end = blocknum;
+       if(referenced_end <= last_block && referenced_end - first_block < CLOOP_REQUEST_BLOCKS)
+        {
+         spin_lock(&clo->cache_lock);
+         queued = cloop_request_reference(w, first_block, first_whole, last_whole, last_block,
+                                          &referenced_end, &pinned, cached, inflate);
+         spin_unlock(&clo->cache_lock);
+         cloop_wake_helpers(w, queued);
+        }
+       referenced = cloop_request_bit(blocknum, first_block, cached);
+       direct = CLOOP_COPY_BUFFER;
+       if(cloop_request_bit(blocknum, first_block, inflate))
+        {
+         int ret = cloop_inflate_start(w, blocknum);
+         if(ret < 0) { uptodate = 0; break; }
+         direct = ret ? CLOOP_COPY_INFLATE : CLOOP_COPY_ZERO;
+        }
+       else if(!referenced && blocknum < ntohl(clo->head.num_blocks) &&
+               cloop_is_direct(clo, blocknum))
+        {
+         direct = CLOOP_COPY_STORED;
+         cloop_stat_inc(clo, stored_blocks);
+        }
+       if(direct == CLOOP_COPY_BUFFER)
+        {
+         from_ptr = cloop_load_buffer(w, blocknum, referenced, &entry);
+         if(from_ptr == NULL) { uptodate = 0; break; } /* invalid data, leave inner loop */
+        }
       }
      /* Now, at least part of what we want will be in the buffer. */
-     length_in_buffer = ntohl(clo->head.block_size) - offset_in_buffer;
+     length_in_buffer = block_size - offset_in_buffer;
      if(length_in_buffer > len)
       {
 /*   DEBUGP("Warning: length_in_buffer=%u > len=%u\n",
                       length_in_buffer,len); */
        length_in_buffer = len;
       }
-     memcpy(to_ptr, from_ptr + offset_in_buffer, length_in_buffer);
+     if(direct == CLOOP_COPY_STORED)
+      {
+       if(cloop_read_direct(w, blocknum, offset_in_buffer, to_ptr, length_in_buffer) != 0)
+        { uptodate = 0; break; }
+      }
+     else if(direct == CLOOP_COPY_INFLATE)
+      {
+       if(cloop_inflate_next(w, blocknum, to_ptr, length_in_buffer,
+                             offset_in_buffer + length_in_buffer == block_size) != 0)
+        { uptodate = 0; break; }
+      }
+     else if(direct == CLOOP_COPY_ZERO)
+      memset(to_ptr, 0, length_in_buffer);
+     else
+      memcpy(to_ptr, from_ptr + offset_in_buffer, length_in_buffer);
      to_ptr      += length_in_buffer;
      len         -= length_in_buffer;
      offset      += length_in_buffer;
     } /* while inner loop */
    kunmap(bvec.bv_page);
+   if(!uptodate) break;
   } /* end rq_for_each_segment*/
- return ((buffered_blocknum!=-1) || preloaded);
+ cloop_release_buffer(clo, entry);
+ /* Drop references to blocks that we did not get to because of an error */
+ for(blocknum = MAX(blocknum + 1, first_block); blocknum < referenced_end; blocknum++)
+  {
+   if(!cloop_request_bit(blocknum, first_block, cached)) continue;
+   spin_lock(&clo->cache_lock);
+   cloop_cache_put(clo, cloop_cache_lookup(&clo->cache, blocknum));
+   spin_unlock(&clo->cache_lock);
+  }
+ return uptodate;
+}
+
+static inline int cloop_preload_pending(struct cloop_device *clo)
+{
+ return (clo->backing_file != NULL &&
+         atomic_read(&clo->preload_next) < clo->preload_size);
+}
+
+/* Load the next block, or chunk of compressed data, of the preload cache.
+ * The workers do this when they are idle, so the device can be used while
+ * it is filled. What can't be read is left out, requests read it the
+ * normal way. */
+static void cloop_preload_one(struct cloop_worker *w)
+{
+ struct cloop_device *clo = w->clo;
+ int n = atomic_inc_return(&clo->preload_next) - 1, ret;
+ if(n >= clo->preload_size) return;
+ if(clo->preload_compressed)
+  {
+   size_t offset = (size_t) n * CLOOP_PRELOAD_CHUNK;
+   size_t len = MIN(clo->preload_bytes - offset, CLOOP_PRELOAD_CHUNK);
+   ssize_t done;
+   if(clo->direct_io) /* the last chunk may go beyond the end of the file */
+    done = cloop_read_direct_io(clo, clo->preload_data + offset,
+                                clo->preload_pos + offset, len);
+   else
+    done = cloop_read_from_file(clo, clo->backing_file, clo->preload_data + offset,
+                                clo->preload_pos + offset, len);
+   ret = (done >= 0 && (done >= len ||
+          clo->preload_pos + offset + done >= i_size_read(clo->backing_inode))) ? 0 : -1;
+  }
+ else
+  ret = cloop_load_block(w, n, clo->preload_data + (size_t) n * ntohl(clo->head.block_size));
+ if(ret == 0)
+  {
+   smp_wmb(); /* data before the bit */
+   set_bit(n, clo->preload_map);
+  }
+ else
+  printk(KERN_WARNING "%s: can't read %s %d into preload cache (ignored).\n",
+                      cloop_name, clo->preload_compressed ? "chunk" : "block", n);
+ if(atomic_inc_return(&clo->preload_done) == clo->preload_size)
+  {
+   if(clo->preload_compressed)
+    printk(KERN_INFO "%s: preloaded %lu bytes of compressed data.\n", cloop_name,
+                     (unsigned long) clo->preload_bytes);
+   else
+    printk(KERN_INFO "%s: preloaded %d blocks into cache.\n", cloop_name,
+                     bitmap_weight(clo->preload_map, clo->preload_size));
+  }
+}
+
+static inline int cloop_has_requests(struct cloop_worker *w)
+{
+ int prio;
+ for(prio = 0; prio < CLOOP_PRIO_CLASSES; prio++)
+  if(w->pending[prio] != NULL || !llist_empty(&w->clo_list[prio])) return 1;
+ return 0;
+}
+
+static inline int cloop_fetch_pending(struct cloop_device *clo)
+{
+ int prio;
+ for(prio = 0; prio < CLOOP_PRIO_CLASSES; prio++)
+  if(!list_empty(&clo->fetch_list[prio])) return 1;
+ return 0;
+}
+
+/* Take the oldest request of class prio of a worker, or NULL. When the ones
+ * taken from its clo_list before are done, all new ones are taken from it in
+ * one go. */
+static struct request *cloop_next_request(struct cloop_worker *w, int prio)
+{
+ struct llist_node *node;
+ if(w->pending[prio] == NULL)
+  w->pending[prio] = llist_reverse_order(llist_del_all(&w->clo_list[prio]));
+ if((node = w->pending[prio]) == NULL) return NULL;
+ w->pending[prio] = node->next;
+ atomic_dec(&w->class_queued[prio]);
+ atomic_dec(&w->queued);
+ return blk_mq_rq_from_pdu(llist_entry(node, struct cloop_cmd, node));
+}
+
+/* Serve the oldest request of class prio, returns 0 if there was none. */
+static int cloop_serve_one(struct cloop_worker *w, int prio)
+{
+ struct cloop_device *clo = w->clo;
+ struct request *req = cloop_next_request(w, prio);
+ int uptodate;
+ if(req == NULL) return 0;
+ w->prio = prio;
+ trace_cloop_request_start(clo->clo_number, w->number, blk_rq_pos(req),
+                           blk_rq_bytes(req), 0);
+ uptodate = cloop_handle_request(w, req);
+ trace_cloop_request_done(clo->clo_number, w->number, blk_rq_pos(req),
+                          blk_rq_bytes(req), uptodate ? 0 : -EIO);
+ cloop_stat_inc(clo, requests);
+ if(uptodate) cloop_stat_add(clo, bytes, blk_rq_bytes(req));
+ else         cloop_stat_inc(clo, request_errors);
+ cloop_stat_latency(clo, request_latency,
+                    ((struct cloop_cmd *) blk_mq_rq_to_pdu(req))->queued);
+ blk_mq_end_request(req, uptodate ? 0 : -EIO);
+ cloop_cache_grow(clo);
+ return 1;
+}
+
+/* Adopted from loop.c, a kernel thread to handle physical reads and
+ * decompression. One of them serves each hardware queue of a device and
+ * completes its requests in order. Idle workers load blocks queued on
+ * fetch_list by the others, so a single large request is also decompressed
+ * in parallel. Work is done by priority class, blocks and requests of demand
+ * reads before those of readahead and warm-up, which only get a worker
+ * between two blocks or requests of their own. */
+static int cloop_thread(void *data)
+{
+ struct cloop_worker *w = data;
+ struct cloop_device *clo = w->clo;
+ current->flags |= PF_NOFREEZE;
+ set_user_nice(current, -15);
+ while (!kthread_should_stop()||cloop_has_requests(w))
+  {
+   int err, prio;
+   err = wait_event_interruptible(w->clo_event, cloop_has_requests(w) ||
+                                  cloop_fetch_pending(clo) ||
+                                  cloop_preload_pending(clo) ||
+                                  kthread_should_stop());
+   if(unlikely(err))
+    {
+     DEBUGP(KERN_ERR "cloop thread activated on error!? Continuing.\n");
+     continue;
+    }
+   down_read(&clo->clo_cache_rwsem);
+   /* In each class, help other workers with their blocks first, preload
+    * when idle */
+   for(prio = 0; prio < CLOOP_PRIO_CLASSES; prio++)
+    if(cloop_fetch_one(w, prio) || cloop_serve_one(w, prio)) break;
+   if(prio == CLOOP_PRIO_CLASSES && cloop_preload_pending(clo))
+    cloop_preload_one(w);
+   up_read(&clo->clo_cache_rwsem);
+  }
+ DEBUGP(KERN_ERR "cloop_thread exited.\n");
+ return 0;
+}
+
+/* This is called by blk-mq for each request sent to one of our hardware
+ * queues. We must not sleep here, so the request is just handed over to
+ * the worker thread that serves this queue. */
+static int cloop_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd)
+{
+ struct request *req = bd->rq;
+ struct cloop_cmd *cmd = blk_mq_rq_to_pdu(req);
+ struct cloop_worker *w = hctx->driver_data;
+ struct cloop_device *clo = w->clo;
+ int rw, queued, max;
+ blk_mq_start_request(req);
+ /* quick sanity checks */
+ /* blk_fs_request() was removed in 2.6.36 */
+ if (unlikely(req->cmd_type != REQ_TYPE_FS))
+  goto error_out;
+ rw = rq_data_dir(req);
+ if (unlikely(rw != READ && rw != READA))
+  {
+   DEBUGP("cloop_queue_rq: bad command\n");
+   goto error_out;
+  }
+ if (unlikely(!clo->backing_file && !clo->suspended))
+  {
+   DEBUGP("cloop_queue_rq: not connected to a file\n");
+   goto error_out;
+  }
+ cmd->queued = ktime_get();
+ /* Readahead of the page cache waits until demand reads are served */
+ cmd->prio = (req->cmd_flags & REQ_RAHEAD) ? CLOOP_PRIO_BACKGROUND : CLOOP_PRIO_DEMAND;
+ atomic_inc(&w->class_queued[cmd->prio]);
+ queued = atomic_inc_return(&w->queued);
+ while((max = atomic_read(&w->queued_max)) < queued &&
+       atomic_cmpxchg(&w->queued_max, max, queued) != max);
+ /* Add to working list for thread, and wake it up unless there were
+  * requests on the list already, then it has been woken up for them. */
+ if(llist_add(&cmd->node, &w->clo_list[cmd->prio]))
+  wake_up(&w->clo_event);
+ return BLK_MQ_RQ_QUEUE_OK;
+error_out:
+ DEBUGP(KERN_ERR "cloop_queue_rq: Discarding request %p.\n", req);
+ return BLK_MQ_RQ_QUEUE_ERROR;
+}
+
+/* Attach each hardware queue to its worker */
+static int cloop_init_hctx(struct blk_mq_hw_ctx *hctx, void *data, unsigned int index)
+{
+ struct cloop_device *clo = data;
+ hctx->driver_data = &clo->workers[index];
+ clo->workers[index].node = hctx->numa_node;
+ return 0;
+}
+
+static struct blk_mq_ops cloop_mq_ops =
+{
+ .queue_rq  = cloop_queue_rq,
+ .map_queue = blk_mq_map_queue,
+ .init_hctx = cloop_init_hctx,
+};
+
+static void cloop_free_preload(struct cloop_device *clo)
+{
+ if(clo->preload_data) cloop_free(clo->preload_data, clo->preload_bytes);
+ if(clo->preload_map)
+  cloop_free(clo->preload_map, BITS_TO_LONGS(clo->preload_size) * sizeof(unsigned long));
+ clo->preload_data = NULL;
+ clo->preload_map = NULL;
+ clo->preload_bytes = clo->preload_size = 0;
+}
+
+/* Allocate the preload cache for the first "blocks" blocks, the workers
+ * fill it later. With preload_compressed, it holds their compressed data as
+ * it is found in the file, from the first to the last block that is not all
+ * zero, but never more than the uncompressed blocks would take. Blocks whose
+ * data is elsewhere, with a different layout of the file, are read from the
+ * file as usual. It is not a fatal error if there is not enough memory, we
+ * preload less then, but we should at least let the user know. */
+static void cloop_preload_alloc(struct cloop_device *clo, unsigned int blocks)
+{
+ u_int32_t block_size = ntohl(clo->head.block_size), length;
+ size_t bytes = (size_t) blocks * block_size, wanted, units;
+ loff_t pos, end = 0;
+ int first, last;
+ clo->preload_pos = 0;
+ /* The data of segmented images is not in one piece, preload blocks */
+ clo->preload_compressed = preload_compressed && !clo->segment_count;
+ atomic_set(&clo->preload_next, 0);
+ atomic_set(&clo->preload_done, 0);
+ if(clo->preload_compressed)
+  {
+   for(first = 0; first < blocks; first++)
+    {
+     if(cloop_block_extent(clo, first, &pos, &length)) return;
+     if(length) break;
+    }
+   if(first == blocks) return; /* nothing to read */
+   clo->preload_pos = pos;
+   for(last = blocks - 1; last >= first; last--)
+    {
+     if(cloop_block_extent(clo, last, &pos, &length)) return;
+     if(length) break;
+    }
+   end = pos + length;
+   if(end > clo->preload_pos) bytes = MIN(bytes, end - clo->preload_pos);
+   if(clo->direct_io)
+    { /* whole underlying blocks, each chunk is read straight into place */
+     bytes += clo->preload_pos & (clo->underlying_blksize - 1);
+     clo->preload_pos -= clo->preload_pos & (clo->underlying_blksize - 1);
+     bytes = ALIGN(bytes, clo->underlying_blksize);
+    }
+  }
+ for(wanted = bytes; bytes > 0; bytes /= 2)
+  {
+   if(!clo->preload_compressed) bytes -= bytes % block_size;
+   else if(clo->direct_io) bytes -= bytes % clo->underlying_blksize;
+   if(bytes == 0) break;
+   if((clo->preload_data = cloop_malloc(bytes)) != NULL) break;
+  }
+ if(clo->preload_data == NULL)
+  {
+   printk(KERN_WARNING "%s: cloop_malloc(%lu) failed, continuing without preloaded buffers.\n",
+          cloop_name, (unsigned long) wanted);
+   return;
+  }
+ if(bytes < wanted)
+  printk(KERN_WARNING "%s: cloop_malloc(%lu) failed, preloading %lu bytes (ignored).\n",
+         cloop_name, (unsigned long) wanted, (unsigned long) bytes);
+ units = clo->preload_compressed ? DIV_ROUND_UP(bytes, CLOOP_PRELOAD_CHUNK) : bytes / block_size;
+ clo->preload_map = cloop_malloc(BITS_TO_LONGS(units) * sizeof(unsigned long));
+ if(clo->preload_map == NULL)
+  {
+   printk(KERN_WARNING "%s: out of memory, continuing without preloaded buffers.\n",
+          cloop_name);
+   cloop_free(clo->preload_data, bytes);
+   clo->preload_data = NULL;
+   return;
+  }
+ memset(clo->preload_map, 0, BITS_TO_LONGS(units) * sizeof(unsigned long));
+ clo->preload_bytes = bytes;
+ /* The workers load them when they have nothing else to do */
+ clo->preload_size = units;
+}
+
+/* Free the buffers and decompressor state of a worker */
+static void cloop_free_worker(struct cloop_device *clo, struct cloop_worker *w)
+{
+ if(w->compressed_buffer) cloop_free(w->compressed_buffer, w->compressed_alloc);
+ if(w->buffer) cloop_free(w->buffer, ntohl(clo->head.block_size));
+ if(w->zstream.workspace)
+  {
+   zlib_inflateEnd(&w->zstream);
+   cloop_free(w->zstream.workspace, zlib_inflate_workspacesize());
+  }
+#ifdef CLOOP_HAVE_XZ
+ if(w->xz) xz_dec_end(w->xz);
+ w->xz = NULL;
+#endif
+ w->compressed_buffer = NULL;
+ w->buffer = NULL;
+ w->zstream.workspace = NULL;
+}
+
+static void cloop_free_workers(struct cloop_device *clo)
+{
+ int i;
+ for(i=0; i<clo->num_workers; i++) cloop_free_worker(clo, &clo->workers[i]);
+}
+
+/* Allocate buffers and decompressor state for a worker, on its node */
+static int cloop_alloc_worker(struct cloop_device *clo, struct cloop_worker *w)
+{
+ w->compressed_size = MAX(clo->largest_block, CLOOP_BATCH_BYTES);
+ w->compressed_alloc = w->compressed_size;
+ if(clo->direct_io) w->compressed_alloc += 2 * clo->underlying_blksize;
+ w->compressed_buffer = cloop_malloc_node(w->compressed_alloc, w->node);
+ if(!w->compressed_buffer)
+  {
+   printk(KERN_ERR "%s: out of memory for compressed buffer %lu\n",
+          cloop_name, (unsigned long) w->compressed_alloc);
+   goto error_nomem;
+  }
+ w->buffer = cloop_malloc_node(ntohl(clo->head.block_size), w->node);
+ if(!w->buffer)
+  {
+   printk(KERN_ERR "%s: out of memory for buffer %lu\n",
+          cloop_name, (unsigned long) ntohl(clo->head.block_size));
+   goto error_nomem;
+  }
+ if(clo->compressors & (1 << CLOOP_COMPRESSOR_ZLIB))
+  {
+   w->zstream.workspace = cloop_malloc_node(zlib_inflate_workspacesize(), w->node);
+   if(!w->zstream.workspace)
+    {
+     printk(KERN_ERR "%s: out of mem for zlib working area %u\n",
+            cloop_name, zlib_inflate_workspacesize());
+     goto error_nomem;
+    }
+   zlib_inflateInit(&w->zstream);
+  }
+#ifdef CLOOP_HAVE_XZ
+ if(clo->compressors & (1 << CLOOP_COMPRESSOR_XZ))
+  {
+   /* Single call mode, the output buffer is the dictionary */
+   w->xz = xz_dec_init(XZ_SINGLE, 0);
+   if(!w->xz)
+    {
+     printk(KERN_ERR "%s: out of mem for xz decoder\n", cloop_name);
+     goto error_nomem;
+    }
+  }
+#endif
+ return 0;
+error_nomem:
+ cloop_free_worker(clo, w);
+ return -ENOMEM;
+}
+
+/* Allocate buffers and decompressor state for all workers of a device,
+ * threads are started later by cloop_start_workers(). */
+static int cloop_alloc_workers(struct cloop_device *clo)
+{
+ int i;
+ for(i=0; i<clo->num_workers; i++)
+  if(cloop_alloc_worker(clo, &clo->workers[i]) != 0)
+   {
+    cloop_free_workers(clo);
+    return -ENOMEM;
+   }
+ return 0;
+}
+
+static void cloop_stop_workers(struct cloop_device *clo)
+{
+ int i;
+ for(i=0; i<clo->num_workers; i++)
+  {
+   struct cloop_worker *w = &clo->workers[i];
+   if(w->thread) { kthread_stop(w->thread); w->thread=NULL; }
+  }
+}
+
+static int cloop_start_workers(struct cloop_device *clo)
+{
+ int i;
+ for(i=0; i<clo->num_workers; i++)
+  {
+   struct cloop_worker *w = &clo->workers[i];
+   w->thread = kthread_create_on_node(cloop_thread, w, w->node, "cloop%d/%d",
+                                      clo->clo_number, i);
+   if(IS_ERR(w->thread))
+    {
+     int error = PTR_ERR(w->thread);
+     w->thread = NULL;
+     cloop_stop_workers(clo);
+     return error;
+    }
+   /* blk-mq sends requests to the queue of the submitting CPU, keep the
+    * worker on the same node as those CPUs and its buffers */
+   if(w->node != NUMA_NO_NODE)
+    set_cpus_allowed_ptr(w->thread, cpumask_of_node(w->node));
+  }
+ for(i=0; i<clo->num_workers; i++) wake_up_process(clo->workers[i].thread);
+ return 0;
+}
+
+/* Start recording the order of the first size blocks read, dropping an
+ * earlier record, or stop recording if size is 0. */
+static int cloop_record_start(struct cloop_device *clo, unsigned int size)
+{
+ unsigned int num_blocks = ntohl(clo->head.num_blocks);
+ size_t map_size = BITS_TO_LONGS(num_blocks) * sizeof(unsigned long);
+ unsigned long *map = NULL, *old_map;
+ u_int32_t *list = NULL, *old_list;
+ unsigned int old_size;
+ if(size > num_blocks) size = num_blocks;
+ if(size > 0)
+  {
+   map = cloop_malloc(map_size);
+   list = cloop_malloc(size * sizeof(u_int32_t));
+   if(map == NULL || list == NULL)
+    {
+     if(map) cloop_free(map, map_size);
+     if(list) cloop_free(list, size * sizeof(u_int32_t));
+     return -ENOMEM;
+    }
+   memset(map, 0, map_size);
+  }
+ down_write(&clo->clo_cache_rwsem);
+ old_map = clo->record_map; old_list = clo->record; old_size = clo->record_size;
+ clo->record_map = map;
+ clo->record = list;
+ clo->record_size = size;
+ atomic_set(&clo->record_count, 0);
+ up_write(&clo->clo_cache_rwsem);
+ if(old_map) cloop_free(old_map, map_size);
+ if(old_list) cloop_free(old_list, old_size * sizeof(u_int32_t));
+ return 0;
 }
 
-/* Adopted from loop.c, a kernel thread to handle physical reads and
- * decompression. */
-static int cloop_thread(void *data)
+/* Background thread that loads the blocks of warm_list into the cache,
+ * with its own buffers at idle CPU and I/O priority, so it stays out of
+ * the way of the workers and of requests. Blocks beyond the size of the
+ * cache would only push out earlier ones, just their compressed data is
+ * read into the page cache. */
+static int cloop_warm_thread(void *data)
 {
- struct cloop_device *clo = data;
- current->flags |= PF_NOFREEZE;
- set_user_nice(current, -15);
- while (!kthread_should_stop()||!list_empty(&clo->clo_list))
+ struct cloop_worker *w = data;
+ struct cloop_device *clo = w->clo;
+ struct file *f;
+ unsigned int i, cached = 0;
+ set_user_nice(current, 19);
+ set_task_ioprio(current, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0));
+ for(i=0; i<clo->warm_count && !kthread_should_stop(); i++)
   {
-   int err;
-   err = wait_event_interruptible(clo->clo_event, !list_empty(&clo->clo_list) || 
-                                  kthread_should_stop());
-   if(unlikely(err))
+   int blocknum = clo->warm_list[i];
+   struct cloop_cache_entry *entry = NULL;
+   loff_t pos;
+   u_int32_t length;
+   if(clo->backing_file == NULL) break; /* suspended */
+   if(cloop_is_preloaded(clo, blocknum)) continue;
+   if(cloop_block_extent(clo, blocknum, &pos, &length)) break;
+   down_read(&clo->clo_cache_rwsem);
+   if(!cloop_is_direct(clo, blocknum))
     {
-     DEBUGP(KERN_ERR "cloop thread activated on error!? Continuing.\n");
-     continue;
+     spin_lock(&clo->cache_lock);
+     if(cached < clo->cache.size && cloop_cache_lookup(&clo->cache, blocknum) == NULL)
+      entry = cloop_cache_get(clo, blocknum, w->prio);
+     spin_unlock(&clo->cache_lock);
     }
-   if(!list_empty(&clo->clo_list))
+   if(entry != NULL)
     {
-     struct request *req;
-     unsigned long flags;
-     int uptodate;
-     spin_lock_irq(&clo->queue_lock);
-     req = list_entry(clo->clo_list.next, struct request, queuelist);
-     list_del_init(&req->queuelist);
-     spin_unlock_irq(&clo->queue_lock);
-     uptodate = cloop_handle_request(clo, req);
-     spin_lock_irqsave(&clo->queue_lock, flags);
-     __blk_end_request_all(req, uptodate ? 0 : -EIO);
-     spin_unlock_irqrestore(&clo->queue_lock, flags);
+     cached++;
+     cloop_cache_wait(w, entry);
+     cloop_release_buffer(clo, entry);
     }
+   else if(length > 0 && !clo->direct_io && (f = cloop_segment(clo, pos, &pos)) != NULL)
+    cloop_readahead_range(f, pos, pos + length);
+   up_read(&clo->clo_cache_rwsem);
   }
- DEBUGP(KERN_ERR "cloop_thread exited.\n");
+ /* Done, wait for cloop_stop_warmup() */
+ set_current_state(TASK_INTERRUPTIBLE);
+ while(!kthread_should_stop())
+  {
+   schedule();
+   set_current_state(TASK_INTERRUPTIBLE);
+  }
+ __set_current_state(TASK_RUNNING);
  return 0;
 }
 
-/* This is called by the kernel block queue management every now and then,
- * with successive read requests qeued and sorted in a (hopefully)
- * "most efficient way". spin_lock_irq() is being held by the kernel. */
-static void cloop_do_request(struct request_queue *q)
+static void cloop_stop_warmup(struct cloop_device *clo)
+{
+ if(clo->warm.thread) { kthread_stop(clo->warm.thread); clo->warm.thread = NULL; }
+ cloop_free_worker(clo, &clo->warm);
+ if(clo->warm_list) cloop_free(clo->warm_list, clo->warm_count * sizeof(u_int32_t));
+ clo->warm_list = NULL;
+ clo->warm_count = 0;
+}
+
+static void cloop_unregister_shrinker(struct cloop_device *clo)
+{
+ if(clo->shrinker_registered) unregister_shrinker(&clo->cache_shrinker);
+ clo->shrinker_registered = 0;
+}
+
+/* A delta image needs its base image attached to another device, found
+ * by its UUID, which is then kept from being detached. Reads the base_map
+ * at pos. */
+static int cloop_attach_base(struct cloop_device *clo, const u_int8_t *uuid, loff_t pos)
 {
- struct request *req;
- while((req = blk_fetch_request(q)) != NULL)
+ unsigned int i, num_blocks = ntohl(clo->head.num_blocks);
+ size_t map_size = num_blocks * sizeof(u_int32_t);
+ struct cloop_device *base = NULL;
+ int error = -EBADF;
+ mutex_lock(&cloop_base_mutex);
+ for(i=0; i<cloop_count && base == NULL; i++)
+  if(cloop_dev[i] != clo && cloop_dev[i]->base_ready &&
+     !memcmp(cloop_dev[i]->uuid, uuid, sizeof(cloop_dev[i]->uuid)))
+   base = cloop_dev[i];
+ if(base == NULL)
   {
-   struct cloop_device *clo;
-   int rw;
- /* quick sanity checks */
-   /* blk_fs_request() was removed in 2.6.36 */
-   if (unlikely(req == NULL || (req->cmd_type != REQ_TYPE_FS)))
-    goto error_continue;
-   rw = rq_data_dir(req);
-   if (unlikely(rw != READ && rw != READA))
+   mutex_unlock(&cloop_base_mutex);
+   printk(KERN_ERR "%s: delta image, base image %pUb is not attached.\n", cloop_name, uuid);
+   return -ENXIO;
+  }
+ /* Keeps the base attached from here on */
+ base->deltas++;
+ mutex_unlock(&cloop_base_mutex);
+ if(base->head.block_size != clo->head.block_size)
+  {
+   printk(KERN_ERR "%s: delta image, base image %s has another block size.\n",
+          cloop_name, base->clo_disk->disk_name);
+   error = -EINVAL; goto error_put;
+  }
+ clo->base_map = cloop_malloc(map_size);
+ if(!clo->base_map)
+  {
+   printk(KERN_ERR "%s: out of kernel mem for base map\n", cloop_name);
+   error = -ENOMEM; goto error_put;
+  }
+ if(cloop_read_from_file(clo, clo->backing_file, (char *) clo->base_map, pos, map_size) != map_size)
+  {
+   printk(KERN_ERR "%s: Bad file, cannot read base map.\n", cloop_name);
+   goto error_free;
+  }
+ for(i=0; i<num_blocks; i++)
+  if(ntohl(clo->base_map[i]) > ntohl(base->head.num_blocks))
+   {
+    printk(KERN_ERR "%s: block %u of the delta image is not in its base image.\n",
+           cloop_name, i);
+    goto error_free;
+   }
+ /* Loads blocks of the base itself, only its own like the warm-up thread */
+ clo->base_worker.clo = base;
+ clo->base_worker.number = base->num_workers;
+ clo->base_worker.max_batch = 1;
+ clo->base_worker.node = NUMA_NO_NODE;
+ if(cloop_alloc_worker(base, &clo->base_worker) != 0)
+  {
+   error = -ENOMEM; goto error_free;
+  }
+ clo->base = base;
+ printk(KERN_INFO "%s: delta of base image %s.\n", cloop_name, base->clo_disk->disk_name);
+ return 0;
+error_free:
+ cloop_free(clo->base_map, map_size);
+ clo->base_map = NULL;
+error_put:
+ mutex_lock(&cloop_base_mutex);
+ base->deltas--;
+ mutex_unlock(&cloop_base_mutex);
+ return error;
+}
+
+static void cloop_detach_base(struct cloop_device *clo)
+{
+ if(clo->base_map) cloop_free(clo->base_map, ntohl(clo->head.num_blocks) * sizeof(u_int32_t));
+ clo->base_map = NULL;
+ if(clo->base)
+  {
+   cloop_free_worker(clo->base, &clo->base_worker);
+   mutex_lock(&cloop_base_mutex);
+   clo->base->deltas--;
+   mutex_unlock(&cloop_base_mutex);
+  }
+ clo->base = NULL;
+}
+
+/* Let delta images find clo as their base, or stop that, which fails while
+ * some of them use it. */
+static int cloop_set_base_ready(struct cloop_device *clo, int ready)
+{
+ int error = 0;
+ mutex_lock(&cloop_base_mutex);
+ if(!ready && clo->deltas > 0) error = -EBUSY;
+ else clo->base_ready = ready;
+ mutex_unlock(&cloop_base_mutex);
+ return error;
+}
+
+static int cloop_alloc_segments(struct cloop_device *clo, unsigned int count)
+{
+ clo->segment_files = cloop_malloc(count * sizeof(struct file *));
+ if(!clo->segment_files) return -ENOMEM;
+ memset(clo->segment_files, 0, count * sizeof(struct file *));
+ clo->segment_count = count;
+ return 0;
+}
+
+/* Drop the segment files of a segmented image */
+static void cloop_put_segments(struct cloop_device *clo)
+{
+ unsigned int i;
+ if(clo->segment_files == NULL) return;
+ for(i=0; i<clo->segment_count; i++)
+  if(clo->segment_files[i]) fput(clo->segment_files[i]);
+ cloop_free(clo->segment_files, clo->segment_count * sizeof(struct file *));
+ clo->segment_files = NULL;
+ clo->segment_count = 0;
+}
+
+/* The segment files of a segmented image must be given in order, their
+ * headers tell. Direct I/O is only used if all of them support it. */
+static int cloop_check_segments(struct cloop_device *clo)
+{
+ struct cloop_segment_head head;
+ unsigned int i;
+ for(i=0; i<clo->segment_count; i++)
+  {
+   struct file *f = clo->segment_files[i];
+   struct inode *inode = file_inode(f);
+   if(!S_ISBLK(inode->i_mode) && !S_ISREG(inode->i_mode))
     {
-     DEBUGP("cloop_do_request: bad command\n");
-     goto error_continue;
+     printk(KERN_ERR "%s: segment %u is not a regular file or block device\n",
+            cloop_name, i+1);
+     return -EBADF;
     }
-   clo = req->rq_disk->private_data;
-   if (unlikely(!clo->backing_file && !clo->suspended))
+   if(cloop_read_from_file(clo, f, (char *) &head, 0, sizeof(head)) != sizeof(head) ||
+      memcmp(head.magic, CLOOP_SEGMENT_MAGIC, sizeof(CLOOP_SEGMENT_MAGIC)) ||
+      memcmp(head.uuid, clo->uuid, sizeof(head.uuid)) || ntohl(head.number) != i+1)
     {
-     DEBUGP("cloop_do_request: not connected to a file\n");
-     goto error_continue;
+     printk(KERN_ERR "%s: file %u is not segment %u of this image.\n",
+            cloop_name, i+1, i+1);
+     return -EBADF;
+    }
+   if(S_ISBLK(inode->i_mode))
+    clo->underlying_blksize = MAX(clo->underlying_blksize, block_size(inode->i_bdev));
+   if(clo->direct_io && !cloop_can_direct_io(f))
+    {
+     printk(KERN_WARNING "%s: segment %u: no direct I/O, using the page cache.\n",
+            cloop_name, i+1);
+     clo->direct_io = 0;
     }
-   list_add_tail(&req->queuelist, &clo->clo_list); /* Add to working list for thread */
-   wake_up(&clo->clo_event);    /* Wake up cloop_thread */
-   continue; /* next request */
-  error_continue:
-   DEBUGP(KERN_ERR "cloop_do_request: Discarding request %p.\n", req);
-   req->errors++;
-   __blk_end_request_all(req, -EIO);
   }
+ return 0;
 }
 
 /* Read header and offsets from already opened file */
@@ -424,10 +2714,15 @@ static int cloop_set_file(int cloop_num, struct file *file, char *filename)
  struct cloop_device *clo = cloop_dev[cloop_num];
  struct inode *inode;
  char *bbuf=NULL;
- unsigned int i, offsets_read, total_offsets;
- int isblkdev;
+ unsigned int i, offset, num_blocks = 0, index_cache_pages;
+ size_t bytes_read;
+ int isblkdev, has_codec_map = 0, has_extents = 0, has_compact_index = 0;
+ int has_block_hashes = 0, is_delta = 0;
+ unsigned int num_segments = 0;
+ size_t hashes_size;
+ u_int8_t base_uuid[16];
  int error = 0;
- inode = file->f_dentry->d_inode;
+ inode = file_inode(file);
  isblkdev=S_ISBLK(inode->i_mode)?1:0;
  if(!isblkdev&&!S_ISREG(inode->i_mode))
   {
@@ -437,6 +2732,7 @@ static int cloop_set_file(int cloop_num, struct file *file, char *filename)
   }
  clo->backing_file = file;
  clo->backing_inode= inode ;
+ clo->isblkdev = isblkdev;
  if(!isblkdev&&inode->i_size<sizeof(struct cloop_head))
   {
    printk(KERN_ERR "%s: %lu bytes (must be >= %u bytes)\n",
@@ -461,6 +2757,10 @@ static int cloop_set_file(int cloop_num, struct file *file, char *filename)
  else
    clo->underlying_blksize = PAGE_SIZE;
  DEBUGP("Underlying blocksize is %u\n", clo->underlying_blksize);
+ clo->direct_io = direct_io && cloop_can_direct_io(file);
+ if(direct_io && !clo->direct_io)
+  printk(KERN_WARNING "%s: %s: no direct I/O, using the page cache.\n",
+         cloop_name, filename);
  bbuf = cloop_malloc(clo->underlying_blksize);
  if(!bbuf)
   {
@@ -468,197 +2768,283 @@ static int cloop_set_file(int cloop_num, struct file *file, char *filename)
                    cloop_name, (unsigned long)clo->underlying_blksize);
    error=-ENOMEM; goto error_release;
   }
- total_offsets = 1; /* Dummy total_offsets: will be filled in first time around */
- for (i = 0, offsets_read = 0; offsets_read < total_offsets; i++)
+ bytes_read = cloop_read_from_file(clo, file, bbuf, 0, clo->underlying_blksize);
+ if(bytes_read != clo->underlying_blksize)
   {
-   unsigned int offset = 0, num_readable;
-   size_t bytes_read = cloop_read_from_file(clo, file, bbuf,
-                                          i*clo->underlying_blksize,
-                                          clo->underlying_blksize);
-   if(bytes_read != clo->underlying_blksize)
-    {
-     printk(KERN_ERR "%s: Bad file, read() of first %lu bytes returned %d.\n",
-                   cloop_name, (unsigned long)clo->underlying_blksize, (int)bytes_read);
-     error=-EBADF;
-     goto error_release;
-    }
-   /* Header will be in block zero */
-   if(i==0)
-    {
-     memcpy(&clo->head, bbuf, sizeof(struct cloop_head));
-     offset = sizeof(struct cloop_head);
-     if (ntohl(clo->head.block_size) % 512 != 0)
-      {
-       printk(KERN_ERR "%s: blocksize %u not multiple of 512\n",
-              cloop_name, ntohl(clo->head.block_size));
-       error=-EBADF; goto error_release;
-      }
-     if (clo->head.preamble[0x0B]!='V'||clo->head.preamble[0x0C]<'1')
-      {
-       printk(KERN_ERR "%s: Cannot read old 32-bit (version 0.68) images, "
+   printk(KERN_ERR "%s: Bad file, read() of first %lu bytes returned %d.\n",
+                 cloop_name, (unsigned long)clo->underlying_blksize, (int)bytes_read);
+   error=-EBADF;
+   goto error_release;
+  }
+ /* Header will be in block zero, the index is read on demand later */
+ clo->largest_block = 0;
+ memcpy(&clo->head, bbuf, sizeof(struct cloop_head));
+ offset = sizeof(struct cloop_head);
+ if (ntohl(clo->head.block_size) % 512 != 0)
+  {
+   printk(KERN_ERR "%s: blocksize %u not multiple of 512\n",
+          cloop_name, ntohl(clo->head.block_size));
+   error=-EBADF; goto error_release;
+  }
+ if (clo->head.preamble[0x0B]!='V'||clo->head.preamble[0x0C]<'1')
+  {
+   printk(KERN_ERR "%s: Cannot read old 32-bit (version 0.68) images, "
 		       "please use an older version of %s for this file.\n",
 		       cloop_name, cloop_name);
-       error=-EBADF; goto error_release;
-      }
-     if (clo->head.preamble[0x0C]<'2')
-      {
-       printk(KERN_ERR "%s: Cannot read old architecture-dependent "
+   error=-EBADF; goto error_release;
+  }
+ if (clo->head.preamble[0x0C]<'2')
+  {
+   printk(KERN_ERR "%s: Cannot read old architecture-dependent "
 		       "(format <= 1.0) images, please use an older "
 		       "version of %s for this file.\n",
 		       cloop_name, cloop_name);
-       error=-EBADF; goto error_release;
-      }
-     total_offsets=ntohl(clo->head.num_blocks)+1;
-     if (!isblkdev && (sizeof(struct cloop_head)+sizeof(loff_t)*
-                       total_offsets > inode->i_size))
-      {
-       printk(KERN_ERR "%s: file too small for %u blocks\n",
-              cloop_name, ntohl(clo->head.num_blocks));
-       error=-EBADF; goto error_release;
-      }
-     clo->offsets = cloop_malloc(sizeof(loff_t) * total_offsets);
-     if (!clo->offsets)
-      {
-       printk(KERN_ERR "%s: out of kernel mem for offsets\n", cloop_name);
-       error=-ENOMEM; goto error_release;
-      }
+   error=-EBADF; goto error_release;
+  }
+ if (clo->head.preamble[0x0C]>'3')
+  {
+   printk(KERN_ERR "%s: Cannot read format version %c images, "
+		       "please use a newer version of %s for this file.\n",
+		       cloop_name, clo->head.preamble[0x0C], cloop_name);
+   error=-EBADF; goto error_release;
+  }
+ clo->compressor = CLOOP_COMPRESSOR_ZLIB;
+ memset(clo->uuid, 0, sizeof(clo->uuid));
+ if (clo->head.preamble[0x0C]=='3')
+  {
+   struct cloop_head_v3 head_v3;
+   memcpy(&head_v3, bbuf + offset, sizeof(struct cloop_head_v3));
+   offset += sizeof(struct cloop_head_v3);
+   if (head_v3.flags & ~CLOOP_FLAGS_SUPPORTED)
+    {
+     printk(KERN_ERR "%s: Unknown image flags 0x%02x, please use a newer "
+                     "version of %s for this file.\n",
+                     cloop_name, head_v3.flags, cloop_name);
+     error=-EBADF; goto error_release;
     }
-   num_readable = MIN(total_offsets - offsets_read,
-                      (clo->underlying_blksize - offset) 
-                      / sizeof(loff_t));
-   memcpy(&clo->offsets[offsets_read], bbuf+offset, num_readable * sizeof(loff_t));
-   offsets_read += num_readable;
-  }
-  { /* Search for largest block rather than estimate. KK. */
-   int i;
-   for(i=0;i<total_offsets-1;i++)
+   if (head_v3.compressor >= CLOOP_COMPRESSOR_MAX)
     {
-     loff_t d=be64_to_cpu(clo->offsets[i+1]) - be64_to_cpu(clo->offsets[i]);
-     clo->largest_block=MAX(clo->largest_block,d);
+     printk(KERN_ERR "%s: Unknown compressor %u.\n",
+                     cloop_name, head_v3.compressor);
+     error=-EBADF; goto error_release;
+    }
+   clo->compressor = head_v3.compressor;
+   has_codec_map = head_v3.flags & CLOOP_FLAG_CODEC_MAP;
+   has_extents = head_v3.flags & CLOOP_FLAG_EXTENTS;
+   has_compact_index = head_v3.flags & CLOOP_FLAG_COMPACT_INDEX;
+   has_block_hashes = head_v3.flags & CLOOP_FLAG_BLOCK_HASHES;
+   is_delta = head_v3.flags & CLOOP_FLAG_DELTA;
+   if(head_v3.flags & CLOOP_FLAG_SEGMENTS) num_segments = head_v3.segments;
+   memcpy(clo->uuid, head_v3.uuid, sizeof(clo->uuid));
+   memcpy(base_uuid, head_v3.base_uuid, sizeof(base_uuid));
+   clo->largest_block = ntohl(head_v3.largest_block);
+   clo->index_group = has_compact_index ? ntohs(head_v3.index_group) : 0;
+   clo->index_length_size = head_v3.index_length_size;
+   clo->index_last = -1;
+   if (has_compact_index &&
+       (has_extents || clo->index_group == 0 ||
+        (clo->index_length_size != sizeof(u_int16_t) &&
+         clo->index_length_size != sizeof(u_int32_t)) ||
+        sizeof(u_int64_t) + clo->index_group * clo->index_length_size > PAGE_SIZE))
+    {
+     printk(KERN_ERR "%s: Bad compact index, %u blocks per group of %u byte lengths.\n",
+                     cloop_name, clo->index_group, clo->index_length_size);
+     error=-EBADF; goto error_release;
+    }
+   if (!has_codec_map && !cloop_compressor_supported(clo->compressor))
+    {
+     printk(KERN_ERR "%s: %s compressed images are not supported "
+                     "by this kernel.\n",
+                     cloop_name, cloop_compressor_names[clo->compressor]);
+     error=-EBADF; goto error_release;
     }
-   printk(KERN_INFO "%s: %s: %u blocks, %u bytes/block, largest block is %lu bytes.\n",
-          cloop_name, filename, ntohl(clo->head.num_blocks),
-          ntohl(clo->head.block_size), clo->largest_block);
   }
-/* Combo kmalloc used too large chunks (>130000). */
- {
-  int i;
-  for(i=0;i<BUFFERED_BLOCKS;i++)
-   {
-    clo->buffer[i] = cloop_malloc(ntohl(clo->head.block_size));
-    if(!clo->buffer[i])
-     {
-      printk(KERN_ERR "%s: out of memory for buffer %lu\n",
-             cloop_name, (unsigned long) ntohl(clo->head.block_size));
-      error=-ENOMEM; goto error_release_free;
-     }
-   }
- }
- clo->compressed_buffer = cloop_malloc(clo->largest_block);
- if(!clo->compressed_buffer)
+ num_blocks = ntohl(clo->head.num_blocks);
+ if (has_compact_index)
   {
-   printk(KERN_ERR "%s: out of memory for compressed buffer %lu\n",
-          cloop_name, clo->largest_block);
-   error=-ENOMEM; goto error_release_free_buffer;
-  }
- clo->zstream.workspace = cloop_malloc(zlib_inflate_workspacesize());
- if(!clo->zstream.workspace)
-  {
-   printk(KERN_ERR "%s: out of mem for zlib working area %u\n",
-          cloop_name, zlib_inflate_workspacesize());
-   error=-ENOMEM; goto error_release_free_all;
-  }
- zlib_inflateInit(&clo->zstream);
- if(!isblkdev &&
-    be64_to_cpu(clo->offsets[ntohl(clo->head.num_blocks)]) != inode->i_size)
-  {
-   printk(KERN_ERR "%s: final offset wrong (%Lu not %Lu)\n",
-          cloop_name,
-          be64_to_cpu(clo->offsets[ntohl(clo->head.num_blocks)]),
-          inode->i_size);
-   cloop_free(clo->zstream.workspace, zlib_inflate_workspacesize()); clo->zstream.workspace=NULL;
-   goto error_release_free_all;
-  }
- {
-  int i;
-  for(i=0; i<BUFFERED_BLOCKS; i++) clo->buffered_blocknum[i] = -1;
-  clo->current_bufnum=0;
- }
- set_capacity(clo->clo_disk, (sector_t)(ntohl(clo->head.num_blocks)*
-              (ntohl(clo->head.block_size)>>9)));
- clo->clo_thread = kthread_create(cloop_thread, clo, "cloop%d", cloop_num);
- if(IS_ERR(clo->clo_thread))
+   clo->index_entry_size = sizeof(u_int64_t) + clo->index_group * clo->index_length_size;
+   clo->index_size = (size_t) clo->index_entry_size *
+                     ((num_blocks + clo->index_group - 1) / clo->index_group);
+  }
+ else if (has_extents)
   {
-   error = PTR_ERR(clo->clo_thread);
-   clo->clo_thread=NULL;
-   goto error_release_free_all;
+   clo->index_entry_size = sizeof(struct cloop_extent);
+   clo->index_size = sizeof(struct cloop_extent) * (size_t) num_blocks;
   }
- if(preload > 0)
+ else
+  {
+   clo->index_entry_size = sizeof(loff_t);
+   clo->index_size = sizeof(loff_t) * ((size_t) num_blocks + 1);
+  }
+ clo->index_per_page = PAGE_SIZE / clo->index_entry_size;
+ clo->index_start = offset;
+ hashes_size = has_block_hashes ? (size_t) num_blocks * CLOOP_HASH_SIZE : 0;
+ if (!isblkdev && (offset+clo->index_size+
+                   (has_codec_map ? num_blocks : 0) + hashes_size +
+                   (is_delta ? num_blocks * sizeof(u_int32_t) : 0) > inode->i_size))
+  {
+   printk(KERN_ERR "%s: file too small for %u blocks\n",
+          cloop_name, num_blocks);
+   error=-EBADF; goto error_release;
+  }
+ cloop_free(bbuf, clo->underlying_blksize);
+ bbuf = NULL;
+ if (num_segments != clo->segment_count)
+  {
+   printk(KERN_ERR "%s: %s: image has %u segment files, %u given (see CLOOP_SET_SEGMENTS).\n",
+          cloop_name, filename, num_segments, clo->segment_count);
+   error=-EINVAL; goto error_release;
+  }
+ if (num_segments && !has_extents && !has_compact_index)
   {
-   clo->preload_array_size = ((preload<=ntohl(clo->head.num_blocks))?preload:ntohl(clo->head.num_blocks));
-   clo->preload_size = 0;
-   if((clo->preload_cache = cloop_malloc(clo->preload_array_size * sizeof(char *))) != NULL)
+   printk(KERN_ERR "%s: segmented image without extents or compact index.\n", cloop_name);
+   error=-EBADF; goto error_release;
+  }
+ error = cloop_check_segments(clo);
+ if(error) goto error_release;
+ /* Images without the size of the largest block get the worst case size */
+ if (clo->largest_block == 0)
+  clo->largest_block = ntohl(clo->head.block_size) + ntohl(clo->head.block_size)/250 + 256;
+ index_cache_pages = MIN(index_pages, (clo->index_size / clo->index_entry_size +
+                                       clo->index_per_page - 1) / clo->index_per_page);
+ clo->index_spare = cloop_malloc(PAGE_SIZE);
+ if (!clo->index_spare ||
+     cloop_cache_alloc(&clo->index_cache, index_cache_pages, PAGE_SIZE))
+  {
+   printk(KERN_ERR "%s: out of kernel mem for index cache\n", cloop_name);
+   error=-ENOMEM; goto error_release_free;
+  }
+ clo->compressors = 1 << clo->compressor;
+ if(has_codec_map)
+  {
+   clo->codec_map = cloop_malloc(num_blocks);
+   if (!clo->codec_map)
+    {
+     printk(KERN_ERR "%s: out of kernel mem for codec map\n", cloop_name);
+     error=-ENOMEM; goto error_release_free;
+    }
+   if(cloop_read_from_file(clo, file, clo->codec_map,
+                           clo->index_start + clo->index_size,
+                           num_blocks) != num_blocks)
+    {
+     printk(KERN_ERR "%s: Bad file, cannot read codec map.\n", cloop_name);
+     error=-EBADF; goto error_release_free;
+    }
+   clo->compressors = 0;
+   for(i=0; i<num_blocks; i++)
     {
-     int i;
-     for(i=0; i<clo->preload_array_size; i++)
+     int compressor = clo->codec_map[i];
+     if(compressor >= CLOOP_COMPRESSOR_MAX)
       {
-       if((clo->preload_cache[i] = cloop_malloc(ntohl(clo->head.block_size))) == NULL)
-        { /* Out of memory */
-         printk(KERN_WARNING "%s: cloop_malloc(%d) failed for preload_cache[%d] (ignored).\n",
-                             cloop_name, ntohl(clo->head.block_size), i);
-	 break;
-	}
+       printk(KERN_ERR "%s: Unknown compressor %u for block %u.\n",
+                       cloop_name, compressor, i);
+       error=-EBADF; goto error_release_free;
       }
-     clo->preload_size = i;
-     for(i=0; i<clo->preload_size; i++)
+     if(!(clo->compressors & (1 << compressor)) && !cloop_compressor_supported(compressor))
       {
-       int buffered_blocknum = cloop_load_buffer(clo,i);
-       if(buffered_blocknum >= 0)
-        {
-	 memcpy(clo->preload_cache[i], clo->buffer[buffered_blocknum],
-	        ntohl(clo->head.block_size));
-	}
-       else
-        {
-         printk(KERN_WARNING "%s: can't read block %d into preload cache, set to zero.\n",
-	                     cloop_name, i);
-	 memset(clo->preload_cache[i], 0, ntohl(clo->head.block_size));
-	}
+       printk(KERN_ERR "%s: %s compressed blocks are not supported "
+                       "by this kernel.\n",
+                       cloop_name, cloop_compressor_names[compressor]);
+       error=-EBADF; goto error_release_free;
       }
-     printk(KERN_INFO "%s: preloaded %d blocks into cache.\n", cloop_name,
-                      (int)clo->preload_size);
+     clo->compressors |= 1 << compressor;
     }
-   else
+  }
+ /* Without the shared cache, the hashes are not needed */
+ if(has_block_hashes && cloop_shared_hash)
+  {
+   clo->block_hashes = cloop_malloc(hashes_size);
+   if (!clo->block_hashes)
+    {
+     printk(KERN_ERR "%s: out of kernel mem for block hashes\n", cloop_name);
+     error=-ENOMEM; goto error_release_free;
+    }
+   if(cloop_read_from_file(clo, file, clo->block_hashes,
+                           clo->index_start + clo->index_size +
+                           (has_codec_map ? num_blocks : 0),
+                           hashes_size) != hashes_size)
     {
-     /* It is not a fatal error if cloop_malloc(clo->preload_size)
-      * fails, then we just go without cache, but we should at least
-      * let the user know. */
-     printk(KERN_WARNING "%s: cloop_malloc(%d) failed, continuing without preloaded buffers.\n",
-            cloop_name, (int)(clo->preload_size * sizeof(char *)));
-     clo->preload_array_size = clo->preload_size = 0;
+     printk(KERN_ERR "%s: Bad file, cannot read block hashes.\n", cloop_name);
+     error=-EBADF; goto error_release_free;
     }
   }
- wake_up_process(clo->clo_thread);
+ if(is_delta)
+  {
+   error = cloop_attach_base(clo, base_uuid,
+                             clo->index_start + clo->index_size +
+                             (has_codec_map ? num_blocks : 0) + hashes_size);
+   if(error) goto error_release_free;
+  }
+ printk(KERN_INFO "%s: %s: %u blocks, %u bytes/block, largest block is %lu bytes, %s compressed.\n",
+        cloop_name, filename, ntohl(clo->head.num_blocks),
+        ntohl(clo->head.block_size), clo->largest_block,
+        has_codec_map ? "per block" : cloop_compressor_names[clo->compressor]);
+ cloop_stats_reset(clo);
+/* Combo kmalloc used too large chunks (>130000). */
+ if(cloop_cache_alloc(&clo->cache, clo->cache_blocks, ntohl(clo->head.block_size)))
+  {
+   printk(KERN_ERR "%s: out of memory for %u cache buffers of %lu bytes\n",
+          cloop_name, clo->cache_blocks, (unsigned long) ntohl(clo->head.block_size));
+   error=-ENOMEM; goto error_release_free;
+  }
+ error = cloop_alloc_workers(clo);
+ if(error) goto error_release_free_buffer;
+ /* Blocks are checked when they are read, only the final offset of a
+  * V2 index tells if the file is complete. */
+ if(!isblkdev && !has_extents && !has_compact_index)
+  {
+   u_int64_t data_end = 0;
+   char *entry = cloop_index_get(clo, num_blocks);
+   if(entry)
+    {
+     data_end = be64_to_cpu(*(u_int64_t *) entry);
+     spin_unlock(&clo->index_lock);
+    }
+   if(data_end != inode->i_size)
+    {
+     printk(KERN_ERR "%s: final offset wrong (%Lu not %Lu)\n",
+            cloop_name, data_end, inode->i_size);
+     error=-EBADF; goto error_release_free_all;
+    }
+  }
+ set_capacity(clo->clo_disk, (sector_t)(ntohl(clo->head.num_blocks)*
+              (ntohl(clo->head.block_size)>>9)));
+ if(preload > 0)
+  cloop_preload_alloc(clo, MIN(preload, ntohl(clo->head.num_blocks)));
+ if(record > 0 && cloop_record_start(clo, record) != 0)
+  printk(KERN_WARNING "%s: out of memory for recording %u blocks (ignored).\n",
+         cloop_name, record);
+ clo->cache_shrunk = jiffies;
+ clo->cache_shrinker.count_objects = cloop_cache_count;
+ clo->cache_shrinker.scan_objects = cloop_cache_scan;
+ clo->cache_shrinker.seeks = DEFAULT_SEEKS;
+ clo->shrinker_registered = (register_shrinker(&clo->cache_shrinker) == 0);
+ if(!clo->shrinker_registered)
+  printk(KERN_WARNING "%s: can't register cache shrinker (ignored).\n", cloop_name);
+ error = cloop_start_workers(clo);
+ if(error) goto error_release_free_preload;
+ printk(KERN_INFO "%s: %s: using %u decompression threads.\n",
+        cloop_name, filename, clo->num_workers);
+ cloop_set_base_ready(clo, 1);
  /* Uncheck */
  return error;
+error_release_free_preload:
+ cloop_unregister_shrinker(clo);
+ cloop_record_start(clo, 0);
+ cloop_free_preload(clo);
 error_release_free_all:
- cloop_free(clo->compressed_buffer, clo->largest_block);
- clo->compressed_buffer=NULL;
+ cloop_free_workers(clo);
 error_release_free_buffer:
- {
-  int i;
-  for(i=0; i<BUFFERED_BLOCKS; i++)
-   { 
-    if(clo->buffer[i])
-     {
-      cloop_free(clo->buffer[i], ntohl(clo->head.block_size));
-      clo->buffer[i]=NULL;
-     }
-   }
- }
+ cloop_cache_free(&clo->cache, ntohl(clo->head.block_size));
 error_release_free:
- cloop_free(clo->offsets, sizeof(loff_t) * total_offsets);
- clo->offsets=NULL;
+ cloop_cache_free(&clo->index_cache, PAGE_SIZE);
+ if(clo->index_spare) cloop_free(clo->index_spare, PAGE_SIZE);
+ clo->index_spare=NULL;
+ if(clo->codec_map) cloop_free(clo->codec_map, ntohl(clo->head.num_blocks));
+ clo->codec_map=NULL;
+ if(clo->block_hashes) cloop_free(clo->block_hashes, (size_t) ntohl(clo->head.num_blocks) * CLOOP_HASH_SIZE);
+ clo->block_hashes=NULL;
+ cloop_detach_base(clo);
 error_release:
  if(bbuf) cloop_free(bbuf, clo->underlying_blksize);
  clo->backing_file=NULL;
@@ -683,34 +3069,91 @@ static int cloop_set_fd(int cloop_num, struct file *clo_file,
  return error;
 }
 
+/* Get the files of a segmented image from ioctl arg, the image itself is
+ * then attached like with LOOP_SET_FD */
+static int cloop_set_segments(int cloop_num, struct block_device *bdev,
+                              struct cloop_segment_list __user *arg)
+{
+ struct cloop_device *clo = cloop_dev[cloop_num];
+ u_int32_t count;
+ u_int32_t fd;
+ unsigned int i;
+ int error;
+ if(clo->backing_file || clo->suspended) return -EBUSY;
+ if(get_user(count, &arg->count)) return -EFAULT;
+ if(count < 2 || count > CLOOP_MAX_SEGMENTS + 1) return -EINVAL;
+ error = cloop_alloc_segments(clo, count - 1);
+ if(error) return error;
+ for(i=0; i<clo->segment_count; i++)
+  {
+   if(get_user(fd, &arg->fds[i+1])) { error = -EFAULT; goto out; }
+   if((clo->segment_files[i] = fget(fd)) == NULL) { error = -EBADF; goto out; }
+  }
+ if(get_user(fd, &arg->fds[0])) error = -EFAULT;
+ else error = cloop_set_fd(cloop_num, NULL, bdev, fd);
+out:
+ if(error) cloop_put_segments(clo);
+ return error;
+}
+
+/* Open the segment files of the initial file, see the segments parameter */
+static int cloop_open_segments(struct cloop_device *clo)
+{
+ unsigned int i;
+ int error;
+ if(nsegments == 0) return 0;
+ error = cloop_alloc_segments(clo, nsegments);
+ for(i=0; !error && i<nsegments; i++)
+  {
+   struct file *f = filp_open(segments[i], O_RDONLY|O_LARGEFILE, 0x00);
+   if(IS_ERR(f))
+    {
+     printk(KERN_ERR "%s: Unable to open segment file %s, error %ld\n",
+            cloop_name, segments[i], PTR_ERR(f));
+     error = PTR_ERR(f);
+    }
+   else clo->segment_files[i] = f;
+  }
+ if(error) cloop_put_segments(clo);
+ return error;
+}
+
 /* Drop file and free buffers, both ioctl and initial_file */
 static int cloop_clr_fd(int cloop_num, struct block_device *bdev)
 {
  struct cloop_device *clo = cloop_dev[cloop_num];
  struct file *filp = clo->backing_file;
- int i;
  if(clo->refcnt > 1)	/* we needed one fd for the ioctl */
    return -EBUSY;
  if(filp==NULL) return -EINVAL;
- if(clo->clo_thread) { kthread_stop(clo->clo_thread); clo->clo_thread=NULL; }
+ if(cloop_set_base_ready(clo, 0)) return -EBUSY; /* base of a delta image */
+ cloop_stop_warmup(clo);
+ cloop_stop_workers(clo);
+ cloop_record_start(clo, 0);
  if(filp!=initial_file) fput(filp);
  else { filp_close(initial_file,0); initial_file=NULL; }
  clo->backing_file  = NULL;
  clo->backing_inode = NULL;
- if(clo->offsets) { cloop_free(clo->offsets, clo->underlying_blksize); clo->offsets = NULL; }
- if(clo->preload_cache)
-  {
-   for(i=0; i < clo->preload_size; i++)
-    cloop_free(clo->preload_cache[i], ntohl(clo->head.block_size));
-   cloop_free(clo->preload_cache, clo->preload_array_size * sizeof(char *));
-   clo->preload_cache = NULL;
-   clo->preload_size = clo->preload_array_size = 0;
-  }
- for(i=0; i<BUFFERED_BLOCKS; i++)
-      if(clo->buffer[i]) { cloop_free(clo->buffer[i], ntohl(clo->head.block_size)); clo->buffer[i]=NULL; }
- if(clo->compressed_buffer) { cloop_free(clo->compressed_buffer, clo->largest_block); clo->compressed_buffer = NULL; }
- zlib_inflateEnd(&clo->zstream);
- if(clo->zstream.workspace) { cloop_free(clo->zstream.workspace, zlib_inflate_workspacesize()); clo->zstream.workspace = NULL; }
+ cloop_put_segments(clo);
+ if(clo->codec_map) { cloop_free(clo->codec_map, ntohl(clo->head.num_blocks)); clo->codec_map = NULL; }
+ if(clo->block_hashes)
+  {
+   cloop_free(clo->block_hashes, (size_t) ntohl(clo->head.num_blocks) * CLOOP_HASH_SIZE);
+   clo->block_hashes = NULL;
+  }
+ cloop_free_preload(clo);
+ cloop_unregister_shrinker(clo);
+ cloop_detach_base(clo);
+ printk(KERN_INFO "%s: device %d cache: %Lu hits, %Lu misses, %Lu evictions.\n",
+        cloop_name, cloop_num, clo->cache.hits, clo->cache.misses,
+        clo->cache.evictions);
+ printk(KERN_INFO "%s: device %d index cache: %Lu hits, %Lu misses, %Lu evictions.\n",
+        cloop_name, cloop_num, clo->index_cache.hits, clo->index_cache.misses,
+        clo->index_cache.evictions);
+ cloop_cache_free(&clo->index_cache, PAGE_SIZE);
+ if(clo->index_spare) { cloop_free(clo->index_spare, PAGE_SIZE); clo->index_spare = NULL; }
+ cloop_cache_free(&clo->cache, ntohl(clo->head.block_size));
+ cloop_free_workers(clo);
  if(bdev) invalidate_bdev(bdev);
  if(clo->clo_disk) set_capacity(clo->clo_disk, 0);
  return 0;
@@ -721,6 +3164,11 @@ static int clo_suspend_fd(int cloop_num)
  struct cloop_device *clo = cloop_dev[cloop_num];
  struct file *filp = clo->backing_file;
  if(filp==NULL || clo->suspended) return -EINVAL;
+ /* LOOP_CHANGE_FD can't hand the segment files back */
+ if(clo->segment_count) return -EINVAL;
+ /* Delta images read the base image through its backing file */
+ if(cloop_set_base_ready(clo, 0)) return -EBUSY;
+ cloop_stop_warmup(clo);
  /* Suspend all running requests - FF */
  clo->suspended=1;
  if(filp!=initial_file) fput(filp);
@@ -839,6 +3287,108 @@ static int cloop_get_status64(struct cloop_device *clo,
 }
 /* EOF get/set_status */
 
+static int cloop_set_cache_size(struct cloop_device *clo, unsigned int size)
+{
+ if(size < 1) return -EINVAL;
+ /* Not attached: just remember the size for cloop_set_file() */
+ if(!clo->cache.entries)
+  {
+   clo->cache_blocks = size;
+   return 0;
+  }
+ return cloop_cache_resize(clo, size);
+}
+
+static int cloop_get_cache_stats(struct cloop_device *clo,
+                                 struct cloop_cache_stats __user *arg)
+{
+ struct cloop_cache_stats stats;
+ unsigned int i;
+ if (!arg) return -EINVAL;
+ memset(&stats, 0, sizeof(stats));
+ spin_lock(&clo->cache_lock);
+ stats.size      = clo->cache.entries ? clo->cache.size : clo->cache_blocks;
+ for(i=0; i<clo->cache.size; i++)
+  if(clo->cache.entries[i].blocknum >= 0) stats.used++;
+ stats.hits      = clo->cache.hits;
+ stats.misses    = clo->cache.misses;
+ stats.evictions = clo->cache.evictions;
+ spin_unlock(&clo->cache_lock);
+ if (copy_to_user(arg, &stats, sizeof(stats))) return -EFAULT;
+ return 0;
+}
+
+
+static int cloop_record(struct cloop_device *clo, unsigned int size)
+{
+ if(!clo->backing_file) return -ENXIO;
+ return cloop_record_start(clo, size);
+}
+
+/* Copy the recorded block numbers to user space */
+static int cloop_get_record(struct cloop_device *clo,
+                            struct cloop_block_list __user *arg)
+{
+ struct cloop_block_list list;
+ u_int32_t *blocks = NULL;
+ int err = 0;
+ if (!arg) return -EINVAL;
+ if (copy_from_user(&list, arg, sizeof(list))) return -EFAULT;
+ /* Keep the workers out, so all slots taken are also filled in */
+ down_write(&clo->clo_cache_rwsem);
+ list.total = atomic_read(&clo->record_count);
+ list.count = MIN(list.count, MIN(list.total, clo->record_size));
+ if(list.count > 0)
+  {
+   blocks = cloop_malloc(list.count * sizeof(u_int32_t));
+   if(blocks) memcpy(blocks, clo->record, list.count * sizeof(u_int32_t));
+   else err = -ENOMEM;
+  }
+ up_write(&clo->clo_cache_rwsem);
+ if(!err && (copy_to_user(arg, &list, sizeof(list)) ||
+             (list.count > 0 &&
+              copy_to_user(arg->blocks, blocks, list.count * sizeof(u_int32_t)))))
+  err = -EFAULT;
+ if(blocks) cloop_free(blocks, list.count * sizeof(u_int32_t));
+ return err;
+}
+
+/* Start loading a list of blocks into the cache in the background,
+ * replacing a running one. A NULL list just stops it. */
+static int cloop_warmup(struct cloop_device *clo, struct cloop_block_list __user *arg)
+{
+ struct cloop_block_list list;
+ u_int32_t *blocks;
+ unsigned int i;
+ int err;
+ cloop_stop_warmup(clo);
+ if (!arg) return 0;
+ if (!clo->backing_file) return -ENXIO;
+ if (copy_from_user(&list, arg, sizeof(list))) return -EFAULT;
+ if (list.count == 0) return 0;
+ if (list.count > ntohl(clo->head.num_blocks)) return -EINVAL;
+ blocks = cloop_malloc(list.count * sizeof(u_int32_t));
+ if (!blocks) return -ENOMEM;
+ clo->warm_list = blocks;
+ clo->warm_count = list.count;
+ if (copy_from_user(blocks, arg->blocks, list.count * sizeof(u_int32_t)))
+  { err = -EFAULT; goto error_out; }
+ for(i=0; i<list.count; i++)
+  if(blocks[i] >= ntohl(clo->head.num_blocks)) { err = -EINVAL; goto error_out; }
+ err = cloop_alloc_worker(clo, &clo->warm);
+ if(err) goto error_out;
+ clo->warm.thread = kthread_run(cloop_warm_thread, &clo->warm, "cloop%d/warm", clo->clo_number);
+ if(IS_ERR(clo->warm.thread))
+  {
+   err = PTR_ERR(clo->warm.thread);
+   clo->warm.thread = NULL;
+   goto error_out;
+  }
+ return 0;
+error_out:
+ cloop_stop_warmup(clo);
+ return err;
+}
 
 static int cloop_ioctl(struct block_device *bdev, fmode_t mode,
 	unsigned int cmd, unsigned long arg)
@@ -859,6 +3409,7 @@ static int cloop_ioctl(struct block_device *bdev, fmode_t mode,
      {
       /* Okay, we have again a backing file - get reqs again - FF */
       clo->suspended=0;
+      cloop_set_base_ready(clo, 1);
      }
      break;
    case LOOP_CLR_FD:
@@ -879,6 +3430,24 @@ static int cloop_ioctl(struct block_device *bdev, fmode_t mode,
    case CLOOP_SUSPEND:
      err = clo_suspend_fd(cloop_num);
      break;
+   case CLOOP_SET_SEGMENTS:
+     err = cloop_set_segments(cloop_num, bdev, (struct cloop_segment_list __user *) arg);
+     break;
+   case CLOOP_SET_CACHE_SIZE:
+     err = cloop_set_cache_size(clo, (unsigned int) arg);
+     break;
+   case CLOOP_GET_CACHE_STATS:
+     err = cloop_get_cache_stats(clo, (struct cloop_cache_stats __user *) arg);
+     break;
+   case CLOOP_RECORD:
+     err = cloop_record(clo, (unsigned int) arg);
+     break;
+   case CLOOP_GET_RECORD:
+     err = cloop_get_record(clo, (struct cloop_block_list __user *) arg);
+     break;
+   case CLOOP_WARMUP:
+     err = cloop_warmup(clo, (struct cloop_block_list __user *) arg);
+     break;
    default:
      err = -EINVAL;
   }
@@ -895,11 +3464,17 @@ static int cloop_compat_ioctl(struct block_device *bdev, fmode_t mode,
   case LOOP_CLR_FD:       /* Change arg */ 
   case LOOP_GET_STATUS64: /* Change arg */ 
   case LOOP_SET_STATUS64: /* Change arg */ 
+  case CLOOP_GET_CACHE_STATS: /* Change arg */
+  case CLOOP_GET_RECORD:  /* Change arg */
+  case CLOOP_WARMUP:      /* Change arg */
+  case CLOOP_SET_SEGMENTS: /* Change arg */
 	arg = (unsigned long) compat_ptr(arg);
   case LOOP_SET_STATUS:   /* unchanged */
   case LOOP_GET_STATUS:   /* unchanged */
   case LOOP_SET_FD:       /* unchanged */
   case LOOP_CHANGE_FD:    /* unchanged */
+  case CLOOP_SET_CACHE_SIZE: /* unchanged */
+  case CLOOP_RECORD:      /* unchanged */
 	return cloop_ioctl(bdev, mode, cmd, arg);
 	break;
  }
@@ -946,6 +3521,209 @@ static struct block_device_operations clo_fops =
 	/* locked_ioctl ceased to exist in 2.6.36 */
 };
 
+/* Statistics in /sys/block/cloopN/cloop/, for tuning block size, cache
+ * size and preload. Counters start from zero when a file is attached. */
+struct cloop_attribute
+{
+ struct device_attribute attr;
+ size_t offset; /* of the value in struct cloop_stats or struct cloop_cache */
+};
+
+static inline struct cloop_device *cloop_attr_device(struct device *dev)
+{
+ return dev_to_disk(dev)->private_data;
+}
+
+static ssize_t cloop_attr_stat_show(struct device *dev, struct device_attribute *attr,
+                                    char *buf)
+{
+ struct cloop_device *clo = cloop_attr_device(dev);
+ size_t offset = container_of(attr, struct cloop_attribute, attr)->offset;
+ u_int64_t sum = 0;
+ int cpu;
+ for_each_possible_cpu(cpu)
+  sum += *(u_int64_t *)((char *)per_cpu_ptr(clo->stats, cpu) + offset);
+ return sprintf(buf, "%llu\n", (unsigned long long) sum);
+}
+
+/* One line per bucket: upper limit in microseconds and count */
+static ssize_t cloop_attr_latency_show(struct device *dev, struct device_attribute *attr,
+                                       char *buf)
+{
+ struct cloop_device *clo = cloop_attr_device(dev);
+ size_t offset = container_of(attr, struct cloop_attribute, attr)->offset;
+ ssize_t len = 0;
+ int cpu, i;
+ for(i=0; i<CLOOP_LATENCY_BUCKETS; i++)
+  {
+   u_int64_t sum = 0;
+   for_each_possible_cpu(cpu)
+    sum += ((u_int64_t *)((char *)per_cpu_ptr(clo->stats, cpu) + offset))[i];
+   if(i < CLOOP_LATENCY_BUCKETS - 1)
+    len += scnprintf(buf + len, PAGE_SIZE - len, "%lu %llu\n",
+                     1UL << i, (unsigned long long) sum);
+   else
+    len += scnprintf(buf + len, PAGE_SIZE - len, "inf %llu\n",
+                     (unsigned long long) sum);
+  }
+ return len;
+}
+
+static ssize_t cloop_attr_cache_show(struct device *dev, struct device_attribute *attr,
+                                     char *buf)
+{
+ struct cloop_device *clo = cloop_attr_device(dev);
+ size_t offset = container_of(attr, struct cloop_attribute, attr)->offset;
+ u_int64_t value;
+ spin_lock(&clo->cache_lock);
+ value = *(u_int64_t *)((char *)&clo->cache + offset);
+ spin_unlock(&clo->cache_lock);
+ return sprintf(buf, "%llu\n", (unsigned long long) value);
+}
+
+static ssize_t cloop_attr_index_show(struct device *dev, struct device_attribute *attr,
+                                     char *buf)
+{
+ struct cloop_device *clo = cloop_attr_device(dev);
+ size_t offset = container_of(attr, struct cloop_attribute, attr)->offset;
+ u_int64_t value;
+ spin_lock(&clo->index_lock);
+ value = *(u_int64_t *)((char *)&clo->index_cache + offset);
+ spin_unlock(&clo->index_lock);
+ return sprintf(buf, "%llu\n", (unsigned long long) value);
+}
+
+/* Requests waiting for the workers, now and at most (offset 0 and 1), or
+ * now in priority class offset - 2 */
+static ssize_t cloop_attr_queue_show(struct device *dev, struct device_attribute *attr,
+                                     char *buf)
+{
+ struct cloop_device *clo = cloop_attr_device(dev);
+ int which = container_of(attr, struct cloop_attribute, attr)->offset;
+ unsigned int i, sum = 0;
+ for(i=0; i<clo->num_workers; i++)
+  {
+   struct cloop_worker *w = &clo->workers[i];
+   sum += atomic_read(which == 0 ? &w->queued :
+                      which == 1 ? &w->queued_max : &w->class_queued[which - 2]);
+  }
+ return sprintf(buf, "%u\n", sum);
+}
+
+/* Watermarks of the block cache: cache_high is its number of slots, the
+ * shrinker leaves at least cache_low of them their buffers */
+static ssize_t cloop_attr_watermark_show(struct device *dev, struct device_attribute *attr,
+                                         char *buf)
+{
+ struct cloop_device *clo = cloop_attr_device(dev);
+ int high = container_of(attr, struct cloop_attribute, attr)->offset;
+ unsigned int value;
+ mutex_lock(&clo->clo_ctl_mutex);
+ value = high ? (clo->cache.entries ? clo->cache.size : clo->cache_blocks) :
+                clo->cache_low;
+ mutex_unlock(&clo->clo_ctl_mutex);
+ return sprintf(buf, "%u\n", value);
+}
+
+static ssize_t cloop_attr_watermark_store(struct device *dev, struct device_attribute *attr,
+                                          const char *buf, size_t count)
+{
+ struct cloop_device *clo = cloop_attr_device(dev);
+ int high = container_of(attr, struct cloop_attribute, attr)->offset;
+ unsigned int value;
+ int err = kstrtouint(buf, 0, &value);
+ if(err) return err;
+ mutex_lock(&clo->clo_ctl_mutex);
+ if(high) err = cloop_set_cache_size(clo, value);
+ else clo->cache_low = value;
+ mutex_unlock(&clo->clo_ctl_mutex);
+ return err ? err : count;
+}
+
+/* Cache slots that have a buffer, the others lost it to the shrinker */
+static ssize_t cloop_attr_backed_show(struct device *dev, struct device_attribute *attr,
+                                      char *buf)
+{
+ struct cloop_device *clo = cloop_attr_device(dev);
+ return sprintf(buf, "%u\n", ACCESS_ONCE(clo->cache.backed));
+}
+
+#define CLOOP_ATTR(name, show, offset) \
+ static struct cloop_attribute cloop_attr_##name = \
+  { __ATTR(name, S_IRUGO, show, NULL), offset }
+#define CLOOP_STAT_ATTR(name) \
+ CLOOP_ATTR(name, cloop_attr_stat_show, offsetof(struct cloop_stats, name))
+#define CLOOP_LATENCY_ATTR(name) \
+ CLOOP_ATTR(name, cloop_attr_latency_show, offsetof(struct cloop_stats, name))
+
+CLOOP_STAT_ATTR(requests);
+CLOOP_STAT_ATTR(request_errors);
+CLOOP_STAT_ATTR(bytes);
+CLOOP_STAT_ATTR(preload_hits);
+CLOOP_STAT_ATTR(shared_hits);
+CLOOP_STAT_ATTR(base_blocks);
+CLOOP_STAT_ATTR(stored_blocks);
+CLOOP_STAT_ATTR(uncompressed_blocks);
+CLOOP_STAT_ATTR(inflated_blocks);
+CLOOP_STAT_ATTR(backing_reads);
+CLOOP_STAT_ATTR(backing_bytes);
+CLOOP_LATENCY_ATTR(read_latency);
+CLOOP_LATENCY_ATTR(inflate_latency);
+CLOOP_LATENCY_ATTR(request_latency);
+CLOOP_ATTR(cache_hits, cloop_attr_cache_show, offsetof(struct cloop_cache, hits));
+CLOOP_ATTR(cache_misses, cloop_attr_cache_show, offsetof(struct cloop_cache, misses));
+CLOOP_ATTR(cache_evictions, cloop_attr_cache_show, offsetof(struct cloop_cache, evictions));
+CLOOP_ATTR(index_hits, cloop_attr_index_show, offsetof(struct cloop_cache, hits));
+CLOOP_ATTR(index_misses, cloop_attr_index_show, offsetof(struct cloop_cache, misses));
+CLOOP_ATTR(queue_depth, cloop_attr_queue_show, 0);
+CLOOP_ATTR(queue_depth_max, cloop_attr_queue_show, 1);
+CLOOP_ATTR(queue_depth_demand, cloop_attr_queue_show, 2 + CLOOP_PRIO_DEMAND);
+CLOOP_ATTR(queue_depth_background, cloop_attr_queue_show, 2 + CLOOP_PRIO_BACKGROUND);
+CLOOP_ATTR(cache_reclaims, cloop_attr_cache_show, offsetof(struct cloop_cache, reclaims));
+CLOOP_ATTR(cache_allocated, cloop_attr_backed_show, 0);
+static struct cloop_attribute cloop_attr_cache_high =
+ { __ATTR(cache_high, S_IRUGO|S_IWUSR, cloop_attr_watermark_show, cloop_attr_watermark_store), 1 };
+static struct cloop_attribute cloop_attr_cache_low =
+ { __ATTR(cache_low, S_IRUGO|S_IWUSR, cloop_attr_watermark_show, cloop_attr_watermark_store), 0 };
+
+static struct attribute *cloop_attrs[] =
+{
+ &cloop_attr_requests.attr.attr,
+ &cloop_attr_request_errors.attr.attr,
+ &cloop_attr_bytes.attr.attr,
+ &cloop_attr_preload_hits.attr.attr,
+ &cloop_attr_shared_hits.attr.attr,
+ &cloop_attr_base_blocks.attr.attr,
+ &cloop_attr_stored_blocks.attr.attr,
+ &cloop_attr_uncompressed_blocks.attr.attr,
+ &cloop_attr_inflated_blocks.attr.attr,
+ &cloop_attr_backing_reads.attr.attr,
+ &cloop_attr_backing_bytes.attr.attr,
+ &cloop_attr_read_latency.attr.attr,
+ &cloop_attr_inflate_latency.attr.attr,
+ &cloop_attr_request_latency.attr.attr,
+ &cloop_attr_cache_hits.attr.attr,
+ &cloop_attr_cache_misses.attr.attr,
+ &cloop_attr_cache_evictions.attr.attr,
+ &cloop_attr_index_hits.attr.attr,
+ &cloop_attr_index_misses.attr.attr,
+ &cloop_attr_queue_depth.attr.attr,
+ &cloop_attr_queue_depth_max.attr.attr,
+ &cloop_attr_queue_depth_demand.attr.attr,
+ &cloop_attr_queue_depth_background.attr.attr,
+ &cloop_attr_cache_reclaims.attr.attr,
+ &cloop_attr_cache_allocated.attr.attr,
+ &cloop_attr_cache_high.attr.attr,
+ &cloop_attr_cache_low.attr.attr,
+ NULL
+};
+
+static struct attribute_group cloop_attribute_group =
+{
+ .name  = "cloop",
+ .attrs = cloop_attrs,
+};
+
 static int cloop_register_blkdev(int major_nr)
 {
  return register_blkdev(major_nr, cloop_name);
@@ -959,21 +3737,65 @@ static int cloop_unregister_blkdev(void)
 
 static int cloop_alloc(int cloop_num)
 {
+ int i, j;
  struct cloop_device *clo = (struct cloop_device *) cloop_malloc(sizeof(struct cloop_device));;
  if(clo == NULL) goto error_out;
  cloop_dev[cloop_num] = clo;
  memset(clo, 0, sizeof(struct cloop_device));
  clo->clo_number = cloop_num;
- clo->clo_thread = NULL;
- init_waitqueue_head(&clo->clo_event);
- spin_lock_init(&clo->queue_lock);
+ init_waitqueue_head(&clo->cache_event);
+ spin_lock_init(&clo->cache_lock);
+ spin_lock_init(&clo->index_lock);
+ mutex_init(&clo->index_mutex);
  mutex_init(&clo->clo_ctl_mutex);
- INIT_LIST_HEAD(&clo->clo_list);
- clo->clo_queue = blk_init_queue(cloop_do_request, &clo->queue_lock);
- if(!clo->clo_queue)
+ mutex_init(&clo->base_mutex);
+ init_rwsem(&clo->clo_cache_rwsem);
+ clo->cache_blocks = cache_blocks;
+ clo->cache_low = BUFFERED_BLOCKS;
+ for(j=0; j<CLOOP_PRIO_CLASSES; j++)
+  INIT_LIST_HEAD(&clo->fetch_list[j]);
+ /* One worker per hardware queue, their buffers are allocated in cloop_set_file() */
+ clo->num_workers = workers ? workers : num_online_cpus();
+ clo->workers = cloop_malloc(clo->num_workers * sizeof(struct cloop_worker));
+ if(!clo->workers) goto error_out;
+ memset(clo->workers, 0, clo->num_workers * sizeof(struct cloop_worker));
+ for(i=0; i<clo->num_workers; i++)
+  {
+   struct cloop_worker *w = &clo->workers[i];
+   w->clo = clo;
+   w->number = i;
+   w->max_batch = CLOOP_MAX_BATCH;
+   w->node = NUMA_NO_NODE; /* set by cloop_init_hctx() */
+   for(j=0; j<CLOOP_PRIO_CLASSES; j++)
+    init_llist_head(&w->clo_list[j]);
+   init_waitqueue_head(&w->clo_event);
+  }
+ /* Loads only its own blocks, not the ones other workers queued behind them,
+  * and queues them for the workers as background work */
+ clo->warm.clo = clo;
+ clo->warm.number = clo->num_workers;
+ clo->warm.max_batch = 1;
+ clo->warm.prio = CLOOP_PRIO_BACKGROUND;
+ clo->warm.node = NUMA_NO_NODE;
+ clo->stats = alloc_percpu(struct cloop_stats);
+ if(!clo->stats) goto error_workers;
+ clo->tag_set.ops = &cloop_mq_ops;
+ clo->tag_set.nr_hw_queues = clo->num_workers;
+ clo->tag_set.queue_depth = CLOOP_QUEUE_DEPTH;
+ clo->tag_set.numa_node = NUMA_NO_NODE;
+ clo->tag_set.flags = BLK_MQ_F_SHOULD_MERGE;
+ clo->tag_set.cmd_size = sizeof(struct cloop_cmd);
+ clo->tag_set.driver_data = clo;
+ if(blk_mq_alloc_tag_set(&clo->tag_set))
+  {
+   printk(KERN_ERR "%s: Unable to alloc tag set[%d]\n", cloop_name, cloop_num);
+   goto error_stats;
+  }
+ clo->clo_queue = blk_mq_init_queue(&clo->tag_set);
+ if(IS_ERR(clo->clo_queue))
   {
    printk(KERN_ERR "%s: Unable to alloc queue[%d]\n", cloop_name, cloop_num);
-   goto error_out;
+   goto error_tag_set;
   }
  clo->clo_queue->queuedata = clo;
  clo->clo_disk = alloc_disk(1);
@@ -989,9 +3811,17 @@ static int cloop_alloc(int cloop_num)
  clo->clo_disk->private_data = clo;
  sprintf(clo->clo_disk->disk_name, "%s%d", cloop_name, cloop_num);
  add_disk(clo->clo_disk);
+ if(sysfs_create_group(&disk_to_dev(clo->clo_disk)->kobj, &cloop_attribute_group))
+  printk(KERN_WARNING "%s: Unable to create statistics in sysfs[%d]\n", cloop_name, cloop_num);
  return 0;
 error_disk:
  blk_cleanup_queue(clo->clo_queue);
+error_tag_set:
+ blk_mq_free_tag_set(&clo->tag_set);
+error_stats:
+ free_percpu(clo->stats);
+error_workers:
+ cloop_free(clo->workers, clo->num_workers * sizeof(struct cloop_worker));
 error_out:
  return -ENOMEM;
 }
@@ -1000,9 +3830,13 @@ static void cloop_dealloc(int cloop_num)
 {
  struct cloop_device *clo = cloop_dev[cloop_num];
  if(clo == NULL) return;
+ sysfs_remove_group(&disk_to_dev(clo->clo_disk)->kobj, &cloop_attribute_group);
  del_gendisk(clo->clo_disk);
  blk_cleanup_queue(clo->clo_queue);
+ blk_mq_free_tag_set(&clo->tag_set);
  put_disk(clo->clo_disk);
+ free_percpu(clo->stats);
+ cloop_free(clo->workers, clo->num_workers * sizeof(struct cloop_worker));
  cloop_free(clo, sizeof(struct cloop_device));
  cloop_dev[cloop_num] = NULL;
 }
@@ -1016,6 +3850,11 @@ static int __init cloop_init(void)
  memset(cloop_dev, 0, cloop_max * sizeof(struct cloop_device *));
  cloop_count=0;
  cloop_major=MAJOR_NR;
+ if(shared_cache > 0 && cloop_shared_alloc() != 0)
+  {
+   printk(KERN_WARNING "%s: can't set up the shared cache (ignored).\n", cloop_name);
+   shared_cache = 0;
+  }
  if(cloop_register_blkdev(MAJOR_NR))
   {
    printk(KERN_WARNING "%s: Unable to get major device %d\n", cloop_name,
@@ -1047,9 +3886,13 @@ static int __init cloop_init(void)
      initial_file=NULL; /* if IS_ERR, it's NOT open. */
     }
    else
-     error=cloop_set_file(0,initial_file,file);
+    {
+     error=cloop_open_segments(cloop_dev[0]);
+     if(!error) error=cloop_set_file(0,initial_file,file);
+    }
    if(error)
     {
+     cloop_put_segments(cloop_dev[0]);
      printk(KERN_ERR
             "%s: Unable to get file %s for cloop device, error %d\n",
             cloop_name, file, error);
@@ -1064,6 +3907,7 @@ init_out_dealloc:
  while (cloop_count>0) cloop_dealloc(--cloop_count);
  cloop_unregister_blkdev();
 init_out_cloop_free:
+ cloop_shared_free();
  cloop_free(cloop_dev, cloop_max * sizeof(struct cloop_device *));
  cloop_dev = NULL;
  return error;
@@ -1071,18 +3915,29 @@ init_out_cloop_free:
 
 static void __exit cloop_exit(void)
 {
- int error=0;
+ int error=0, i, cleared;
  if((error=cloop_unregister_blkdev())!=0)
   {
    printk(KERN_ERR "%s: cannot unregister block device\n", cloop_name);
    return;
   }
+ /* Delta images first, they keep their base attached. A delta can be the
+  * base of another one, so leaves go first, until no delta is left. */
+ do
+  {
+   cleared = 0;
+   for(i=0; i<cloop_count; i++)
+    if(cloop_dev[i]->base && cloop_dev[i]->deltas == 0 &&
+       cloop_dev[i]->backing_file && cloop_clr_fd(i, NULL) == 0)
+     cleared = 1;
+  } while(cleared);
  while(cloop_count>0)
   {
    --cloop_count;
    if(cloop_dev[cloop_count]->backing_file) cloop_clr_fd(cloop_count, NULL);
    cloop_dealloc(cloop_count);
   }
+ cloop_shared_free();
  printk("%s: unloaded.\n", cloop_name);
 }
 
@@ -17,10 +17,129 @@ struct cloop_head
 	u_int32_t num_blocks;
 };
 
-/* data_index (num_blocks 64bit pointers, network order)...      */
+/* Version 3 images ("#V3.0 Format") continue the header with */
+/* struct cloop_head_v3, the data_index follows after it.      */
+
+/* Compressors, the kernel must support the one used by an image */
+#define CLOOP_COMPRESSOR_ZLIB 0x0 /* all V2 images */
+#define CLOOP_COMPRESSOR_XZ   0x1 /* .xz stream, CRC32 or no check */
+#define CLOOP_COMPRESSOR_LZ4  0x2 /* LZ4 block format, no frame */
+#define CLOOP_COMPRESSOR_ZSTD 0x3 /* reserved for zstd, not supported */
+#define CLOOP_COMPRESSOR_NONE 0x4 /* stored uncompressed */
+#define CLOOP_COMPRESSOR_MAX  0x5
+
+/* Image flags */
+#define CLOOP_FLAG_CODEC_MAP 0x01 /* codec_map follows the data_index */
+#define CLOOP_FLAG_EXTENTS   0x02 /* data_index is a cloop_extent per block */
+#define CLOOP_FLAG_COMPACT_INDEX 0x04 /* data_index is in groups, see below */
+#define CLOOP_FLAG_BLOCK_HASHES 0x08 /* block_hashes follow the codec_map */
+#define CLOOP_FLAG_DELTA     0x10 /* base_map follows, see below */
+#define CLOOP_FLAG_SEGMENTS  0x20 /* data is in segment files, see below */
+
+struct cloop_head_v3
+{
+	u_int8_t compressor;     /* CLOOP_COMPRESSOR_* of all blocks */
+	u_int8_t flags;          /* CLOOP_FLAG_* */
+	u_int16_t index_group;   /* network order, blocks per compact index group */
+	u_int32_t largest_block; /* network order, 0 if unknown */
+	u_int8_t index_length_size; /* 2 or 4 bytes per compact index length */
+	u_int8_t uuid[16];       /* of this image, random */
+	u_int8_t base_uuid[16];  /* of the base image, with CLOOP_FLAG_DELTA */
+	u_int8_t segments;       /* number of segment files, with CLOOP_FLAG_SEGMENTS */
+	u_int8_t reserved[22];   /* zero */
+};
+
+/* With CLOOP_FLAG_EXTENTS, blocks with the same content share  */
+/* their compressed data, and blocks of zeroes have no data.     */
+struct cloop_extent
+{
+	u_int64_t offset;   /* start of compressed data, network order */
+	u_int32_t length;   /* network order, 0 means all zero */
+	u_int32_t reserved; /* zero */
+};
+
+/* A block hash is the start of the SHA-256 of the uncompressed   */
+/* block, all zero for none. Blocks of images with the same block */
+/* size and hash have the same content, they can share a cache.   */
+#define CLOOP_HASH_SIZE 16
+
+/* A delta image (CLOOP_FLAG_DELTA) takes the blocks that did not */
+/* change from its base image, which must be attached first. Its  */
+/* base_map has the number of the base image block + 1 for them,  */
+/* their index entries have a length of 0 and no data.            */
+
+/* The data of a segmented image (CLOOP_FLAG_SEGMENTS) is in up */
+/* to CLOOP_MAX_SEGMENTS segment files, each starting with a       */
+/* struct cloop_segment_head. The top bits of an offset in its     */
+/* index are the segment, from 1, the rest is the offset in that   */
+/* file. Such images have extents or a compact index, the blocks  */
+/* of a compact index group are in one segment.                   */
+#define CLOOP_SEGMENT_SHIFT 56
+#define CLOOP_MAX_SEGMENTS  255
+#define CLOOP_SEGMENT_MAGIC "#cloop segment\n"
+
+struct cloop_segment_head
+{
+	char magic[16];          /* CLOOP_SEGMENT_MAGIC */
+	u_int8_t uuid[16];       /* of the image */
+	u_int32_t number;        /* network order, 1 for the first */
+	u_int8_t reserved[28];   /* zero */
+};
+
+/* A compact index (CLOOP_FLAG_COMPACT_INDEX) has a group for    */
+/* every index_group blocks: the 64bit offset of its first block  */
+/* and index_group lengths of index_length_size bytes, all little */
+/* endian. The blocks of a group follow each other in the file, a */
+/* length of 0 means all zero. The last group is padded with 0.   */
+
+/* data_index (num_blocks+1 64bit pointers, network order, or    */
+/*   num_blocks struct cloop_extent with CLOOP_FLAG_EXTENTS, or  */
+/*   a compact index)...                                         */
+/* codec_map (num_blocks CLOOP_COMPRESSOR_* bytes, V3 only, if   */
+/*   CLOOP_FLAG_CODEC_MAP is set, overrides the compressor)...   */
+/* block_hashes (num_blocks * CLOOP_HASH_SIZE bytes, V3 only, if */
+/*   CLOOP_FLAG_BLOCK_HASHES is set, see CLOOP_HASH_SIZE)...     */
+/* base_map (num_blocks 32bit numbers, network order, V3 only,   */
+/*   if CLOOP_FLAG_DELTA is set, 0 for blocks of this image)...  */
 /* compressed data (gzip block compressed format)...             */
 
 /* Cloop suspend IOCTL */
 #define CLOOP_SUSPEND 0x4C07
 
+/* Attach a segmented image, like LOOP_SET_FD with the segment files */
+#define CLOOP_SET_SEGMENTS 0x4C15 /* arg: struct cloop_segment_list * */
+
+struct cloop_segment_list
+{
+	u_int32_t count;     /* number of fds */
+	u_int32_t fds[0];    /* the image, then its segments in order */
+};
+
+/* Cloop block cache IOCTLs */
+#define CLOOP_SET_CACHE_SIZE  0x4C10 /* arg: number of cached blocks */
+#define CLOOP_GET_CACHE_STATS 0x4C11 /* arg: struct cloop_cache_stats * */
+
+struct cloop_cache_stats
+{
+	u_int32_t size;      /* number of cache slots */
+	u_int32_t used;      /* slots currently holding a block */
+	u_int64_t hits;      /* lookups served from the cache */
+	u_int64_t misses;    /* lookups that had to read and uncompress */
+	u_int64_t evictions; /* cached blocks dropped to make room */
+};
+
+/* Cloop access recording and cache warm-up IOCTLs */
+#define CLOOP_RECORD     0x4C12 /* arg: number of blocks to record, 0 stops */
+#define CLOOP_GET_RECORD 0x4C13 /* arg: struct cloop_block_list * */
+#define CLOOP_WARMUP     0x4C14 /* arg: struct cloop_block_list *, NULL stops */
+
+/* Block numbers in the order they were first read (CLOOP_GET_RECORD), */
+/* or to be loaded into the cache in the background (CLOOP_WARMUP).     */
+struct cloop_block_list
+{
+	u_int32_t count;     /* in: size of blocks[], out: number returned */
+	u_int32_t total;     /* out: number of blocks read since recording started */
+	u_int32_t blocks[0];
+};
+
 #endif /*_COMPRESSED_LOOP_H*/
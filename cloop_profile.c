@@ -0,0 +1,112 @@
+/*
+ * cloop_profile - Save the order in which blocks of a cloop device were
+ *                 first read, and load them into its cache in the
+ *                 background on a later boot.
+ *
+ * License: GPL, v2.
+ *
+ */
+
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/* We don't use the structure, so that define does not hurt */
+#define dev_t int
+#include <linux/loop.h>
+#include "cloop.h"
+
+#define MAX_BLOCKS (1 << 20)
+
+static int usage(const char *progname)
+{
+	fprintf(stderr, "syntax: %s <device> record [n]\n", progname);
+	fprintf(stderr, "        start recording the first n blocks read (0 stops)\n");
+	fprintf(stderr, "        %s <device> save\n", progname);
+	fprintf(stderr, "        print the recorded block numbers, one per line\n");
+	fprintf(stderr, "        %s <device> warmup < list\n", progname);
+	fprintf(stderr, "        load the blocks of a saved list into the cache\n");
+	fprintf(stderr, "        %s <device> stop\n", progname);
+	fprintf(stderr, "        stop loading them\n");
+	return 1;
+}
+
+int main(int argc, char** argv)
+{
+	struct cloop_block_list *list;
+	unsigned long block;
+	uint32_t i;
+	int fd;
+
+	if (argc < 3)
+		return usage(argv[0]);
+
+	fd = open(argv[1], O_RDONLY);
+	if (fd < 0)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+
+	list = malloc(sizeof(*list) + MAX_BLOCKS * sizeof(uint32_t));
+	if (list == NULL)
+	{
+		perror("malloc");
+		return 1;
+	}
+	memset(list, 0, sizeof(*list));
+
+	if (!strcmp(argv[2], "record"))
+	{
+		unsigned long n = (argc > 3) ? strtoul(argv[3], NULL, 0) : MAX_BLOCKS;
+		if (ioctl(fd, CLOOP_RECORD, n) < 0)
+		{
+			perror("ioctl: CLOOP_RECORD");
+			return 1;
+		}
+	}
+	else if (!strcmp(argv[2], "save"))
+	{
+		list->count = MAX_BLOCKS;
+		if (ioctl(fd, CLOOP_GET_RECORD, list) < 0)
+		{
+			perror("ioctl: CLOOP_GET_RECORD");
+			return 1;
+		}
+		for (i = 0; i < list->count; i++)
+			printf("%u\n", list->blocks[i]);
+		if (list->total > list->count)
+			fprintf(stderr, "%s: %u of %u blocks were recorded.\n",
+				argv[0], list->count, list->total);
+	}
+	else if (!strcmp(argv[2], "warmup"))
+	{
+		while (list->count < MAX_BLOCKS && scanf("%lu", &block) == 1)
+			list->blocks[list->count++] = block;
+		if (ioctl(fd, CLOOP_WARMUP, list) < 0)
+		{
+			perror("ioctl: CLOOP_WARMUP");
+			return 1;
+		}
+	}
+	else if (!strcmp(argv[2], "stop"))
+	{
+		if (ioctl(fd, CLOOP_WARMUP, NULL) < 0)
+		{
+			perror("ioctl: CLOOP_WARMUP");
+			return 1;
+		}
+	}
+	else
+		return usage(argv[0]);
+
+	close(fd);
+
+	return 0;
+}
@@ -0,0 +1,70 @@
+/*
+ * cloop_segments - Attach a segmented image, written by advfs -n or -z,
+ *                  together with its segment files to a cloop device.
+ *
+ * License: GPL, v2.
+ *
+ */
+
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+/* We don't use the structure, so that define does not hurt */
+#define dev_t int
+#include <linux/loop.h>
+#include "cloop.h"
+
+int main(int argc, char** argv)
+{
+	struct cloop_segment_list *list;
+	int fd, i;
+
+	if (argc < 4 || argc - 2 > CLOOP_MAX_SEGMENTS + 1)
+	{
+		fprintf(stderr, "syntax: %s <device> <image> <segment>...\n", argv[0]);
+		fprintf(stderr, "        attaches <image> to <device>, with its\n");
+		fprintf(stderr, "        segment files in order (image.1 image.2 ...)\n");
+		return 1;
+	}
+
+	fd = open(argv[1], O_RDONLY);
+	if (fd < 0)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+
+	list = malloc(sizeof(*list) + (argc - 2) * sizeof(uint32_t));
+	if (list == NULL)
+	{
+		perror("malloc");
+		return 1;
+	}
+	list->count = argc - 2;
+	for (i = 2; i < argc; i++)
+	{
+		int file = open(argv[i], O_RDONLY);
+		if (file < 0)
+		{
+			perror(argv[i]);
+			return 1;
+		}
+		list->fds[i - 2] = file;
+	}
+
+	if (ioctl(fd, CLOOP_SET_SEGMENTS, list) < 0)
+	{
+		perror("ioctl: CLOOP_SET_SEGMENTS");
+		return 1;
+	}
+
+	close(fd);
+
+	return 0;
+}
@@ -0,0 +1,147 @@
+/* Tracepoints of the cloop read path, see events/cloop/ in tracefs.
+ * Block numbers are those of the cloop image, dev is the cloop minor. */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM cloop
+
+#if !defined(_CLOOP_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _CLOOP_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* Compressed data of count blocks read from the backing file */
+DECLARE_EVENT_CLASS(cloop_fetch,
+ TP_PROTO(int dev, int blocknum, int count, loff_t pos, size_t length),
+ TP_ARGS(dev, blocknum, count, pos, length),
+ TP_STRUCT__entry(
+  __field(int, dev)
+  __field(int, blocknum)
+  __field(int, count)
+  __field(loff_t, pos)
+  __field(size_t, length)
+ ),
+ TP_fast_assign(
+  __entry->dev = dev;
+  __entry->blocknum = blocknum;
+  __entry->count = count;
+  __entry->pos = pos;
+  __entry->length = length;
+ ),
+ TP_printk("cloop%d block %d count %d pos %lld length %zu",
+           __entry->dev, __entry->blocknum, __entry->count,
+           (long long) __entry->pos, __entry->length)
+);
+
+DEFINE_EVENT(cloop_fetch, cloop_fetch_start,
+ TP_PROTO(int dev, int blocknum, int count, loff_t pos, size_t length),
+ TP_ARGS(dev, blocknum, count, pos, length));
+
+DEFINE_EVENT(cloop_fetch, cloop_fetch_done,
+ TP_PROTO(int dev, int blocknum, int count, loff_t pos, size_t length),
+ TP_ARGS(dev, blocknum, count, pos, length));
+
+/* Uncompressing one block, length is compressed before and uncompressed
+ * after, ret 0 or a decompressor error */
+TRACE_EVENT(cloop_decompress_start,
+ TP_PROTO(int dev, int blocknum, int compressor, unsigned int length),
+ TP_ARGS(dev, blocknum, compressor, length),
+ TP_STRUCT__entry(
+  __field(int, dev)
+  __field(int, blocknum)
+  __field(int, compressor)
+  __field(unsigned int, length)
+ ),
+ TP_fast_assign(
+  __entry->dev = dev;
+  __entry->blocknum = blocknum;
+  __entry->compressor = compressor;
+  __entry->length = length;
+ ),
+ TP_printk("cloop%d block %d compressor %d length %u",
+           __entry->dev, __entry->blocknum, __entry->compressor, __entry->length)
+);
+
+TRACE_EVENT(cloop_decompress_done,
+ TP_PROTO(int dev, int blocknum, int ret, unsigned long length),
+ TP_ARGS(dev, blocknum, ret, length),
+ TP_STRUCT__entry(
+  __field(int, dev)
+  __field(int, blocknum)
+  __field(int, ret)
+  __field(unsigned long, length)
+ ),
+ TP_fast_assign(
+  __entry->dev = dev;
+  __entry->blocknum = blocknum;
+  __entry->ret = ret;
+  __entry->length = length;
+ ),
+ TP_printk("cloop%d block %d ret %d length %lu",
+           __entry->dev, __entry->blocknum, __entry->ret, __entry->length)
+);
+
+/* Lookups of a block in the block cache and the preload cache */
+DECLARE_EVENT_CLASS(cloop_block,
+ TP_PROTO(int dev, int blocknum),
+ TP_ARGS(dev, blocknum),
+ TP_STRUCT__entry(
+  __field(int, dev)
+  __field(int, blocknum)
+ ),
+ TP_fast_assign(
+  __entry->dev = dev;
+  __entry->blocknum = blocknum;
+ ),
+ TP_printk("cloop%d block %d", __entry->dev, __entry->blocknum)
+);
+
+DEFINE_EVENT(cloop_block, cloop_cache_hit,
+ TP_PROTO(int dev, int blocknum),
+ TP_ARGS(dev, blocknum));
+
+DEFINE_EVENT(cloop_block, cloop_cache_miss,
+ TP_PROTO(int dev, int blocknum),
+ TP_ARGS(dev, blocknum));
+
+DEFINE_EVENT(cloop_block, cloop_preload_hit,
+ TP_PROTO(int dev, int blocknum),
+ TP_ARGS(dev, blocknum));
+
+/* A request taken from its queue by a worker, and completed */
+DECLARE_EVENT_CLASS(cloop_request,
+ TP_PROTO(int dev, int worker, sector_t sector, unsigned int bytes, int error),
+ TP_ARGS(dev, worker, sector, bytes, error),
+ TP_STRUCT__entry(
+  __field(int, dev)
+  __field(int, worker)
+  __field(sector_t, sector)
+  __field(unsigned int, bytes)
+  __field(int, error)
+ ),
+ TP_fast_assign(
+  __entry->dev = dev;
+  __entry->worker = worker;
+  __entry->sector = sector;
+  __entry->bytes = bytes;
+  __entry->error = error;
+ ),
+ TP_printk("cloop%d/%d sector %llu bytes %u error %d",
+           __entry->dev, __entry->worker, (unsigned long long) __entry->sector,
+           __entry->bytes, __entry->error)
+);
+
+DEFINE_EVENT(cloop_request, cloop_request_start,
+ TP_PROTO(int dev, int worker, sector_t sector, unsigned int bytes, int error),
+ TP_ARGS(dev, worker, sector, bytes, error));
+
+DEFINE_EVENT(cloop_request, cloop_request_done,
+ TP_PROTO(int dev, int worker, sector_t sector, unsigned int bytes, int error),
+ TP_ARGS(dev, worker, sector, bytes, error));
+
+#endif /* _CLOOP_TRACE_H */
+
+/* Built out of the kernel tree, the Makefile adds -I$(src) */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE cloop_trace
+#include <trace/define_trace.h>
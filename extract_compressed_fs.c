@@ -13,13 +13,17 @@
 #include <endian.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
 #include <zlib.h>
 #include <netinet/in.h>
 #include <inttypes.h>
-
-#ifdef __CYGWIN__
-typedef uint64_t loff_t;
+#ifdef HAVE_LIBLZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_LIBLZ4
+#include <lz4.h>
 #endif
+
 #ifndef be64toh
 static __inline __uint64_t
 __bswap64(__uint64_t _x)
@@ -45,16 +49,59 @@ struct compressed_block
 	void *data;
 };
 
+static const char *compressor_names[CLOOP_COMPRESSOR_MAX] =
+	{ "zlib", "xz", "lz4", "unknown", "none" };
+
+/* Uncompress a block that is not zlib compressed, returns 0 on success */
+static int uncompress_other(int compressor, unsigned char *dest, uLongf *destlen,
+			    const unsigned char *source, int size)
+{
+	switch (compressor) {
+	case CLOOP_COMPRESSOR_NONE:
+		if (size > *destlen)
+			return -1;
+		memcpy(dest, source, size);
+		*destlen = size;
+		return 0;
+#ifdef HAVE_LIBLZMA
+	case CLOOP_COMPRESSOR_XZ: {
+		uint64_t memlimit = UINT64_MAX;
+		size_t in_pos = 0, out_pos = 0;
+		if (lzma_stream_buffer_decode(&memlimit, 0, NULL, source, &in_pos,
+					      size, dest, &out_pos, *destlen) != LZMA_OK)
+			return -1;
+		*destlen = out_pos;
+		return 0;
+	}
+#endif
+#ifdef HAVE_LIBLZ4
+	case CLOOP_COMPRESSOR_LZ4: {
+		int len = LZ4_decompress_safe((const char *)source, (char *)dest,
+					      size, *destlen);
+		if (len < 0)
+			return -1;
+		*destlen = len;
+		return 0;
+	}
+#endif
+	}
+	return -1;
+}
+
 int main(int argc, char *argv[])
 {
 	int handle, output;
 	unsigned int i, total_blocks, total_offsets, offsets_size,
 	    compressed_buffer_size, uncompressed_buffer_size;
 	struct cloop_head head;
-	unsigned char *compressed_buffer, *uncompressed_buffer;
-	loff_t *offsets;
+	int compressor = CLOOP_COMPRESSOR_ZLIB, flags = 0;
+	unsigned int index_group = 0, index_length_size = 0, num_segments = 0;
+	int segment[CLOOP_MAX_SEGMENTS];
+	unsigned char *compressed_buffer, *uncompressed_buffer, *codec_map = NULL;
+	uint64_t *offsets = NULL, pos;
+	struct cloop_extent *extents = NULL;
 	/* For statistics */
-	loff_t compressed_bytes, uncompressed_bytes, block_modulo;
+	uint64_t compressed_bytes, uncompressed_bytes, block_modulo;
 
 	if (argc != 3) {
 		fprintf(stderr, "Syntax: %s infile outfile, use \"-\" for stdin/stdout.\n", argv[0]);
@@ -94,16 +141,67 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
+	if (head.preamble[0x0B] != 'V' || head.preamble[0x0C] < '2' ||
+	    head.preamble[0x0C] > '3') {
+		fprintf(stderr, "%s: unsupported cloop format version.\n", argv[0]);
+		exit(1);
+	}
+
+	if (head.preamble[0x0C] == '3') {
+		struct cloop_head_v3 head_v3;
+		if (read(handle, &head_v3, sizeof(head_v3)) != sizeof(head_v3)) {
+			perror("Reading compressed file header\n");
+			exit(1);
+		}
+		compressor = head_v3.compressor;
+		flags = head_v3.flags;
+		index_group = ntohs(head_v3.index_group);
+		index_length_size = head_v3.index_length_size;
+		if (flags & CLOOP_FLAG_DELTA) {
+			fprintf(stderr, "%s: delta image, the blocks of its base image are "
+			        "only available through the cloop driver.\n", argv[0]);
+			exit(1);
+		}
+		if (flags & CLOOP_FLAG_SEGMENTS)
+			num_segments = head_v3.segments;
+		if ((flags & ~(CLOOP_FLAG_CODEC_MAP|CLOOP_FLAG_EXTENTS|CLOOP_FLAG_COMPACT_INDEX|
+		               CLOOP_FLAG_BLOCK_HASHES|CLOOP_FLAG_SEGMENTS)) ||
+		    (num_segments && !(flags & (CLOOP_FLAG_EXTENTS|CLOOP_FLAG_COMPACT_INDEX))) ||
+		    ((flags & CLOOP_FLAG_COMPACT_INDEX) &&
+		     ((flags & CLOOP_FLAG_EXTENTS) || index_group == 0 ||
+		      (index_length_size != 2 && index_length_size != 4))) ||
+		    compressor >= CLOOP_COMPRESSOR_MAX) {
+			fprintf(stderr, "%s: unsupported image flags or compressor.\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	/* The data of segmented images is in infile.1, infile.2, ... */
+	if (num_segments && handle == STDIN_FILENO) {
+		fprintf(stderr, "%s: segmented image, give its file name.\n", argv[0]);
+		exit(1);
+	}
+	for (i = 0; i < num_segments; i++) {
+		char name[PATH_MAX];
+		snprintf(name, sizeof(name), "%s.%u", argv[1], i + 1);
+		segment[i] = open(name, O_RDONLY|O_LARGEFILE);
+		if (segment[i] < 0) {
+			perror(name);
+			exit(1);
+		}
+	}
+
 	total_blocks = ntohl(head.num_blocks);
 	uncompressed_buffer_size = ntohl(head.block_size);
 
-	fprintf(stderr, "%s: compressed input has %u blocks of size %u.\n",
-		argv[0], total_blocks, uncompressed_buffer_size);
+	fprintf(stderr, "%s: compressed input has %u blocks of size %u (%s).\n",
+		argv[0], total_blocks, uncompressed_buffer_size,
+		(flags & CLOOP_FLAG_CODEC_MAP) ? "per block" : compressor_names[compressor]);
 
 
-	/* The maximum size of a compressed block, due to the
-	 * specification of uncompress() */
-	compressed_buffer_size = uncompressed_buffer_size + uncompressed_buffer_size/1000 + 12 + 4;
+	/* The maximum size of a compressed block, covering the worst
+	 * case expansion of all compressors */
+	compressed_buffer_size = uncompressed_buffer_size + uncompressed_buffer_size/250 + 256;
 	compressed_buffer = malloc(compressed_buffer_size);
 	if (compressed_buffer == NULL) {
 		perror("Out of memory for compressed buffer");
@@ -120,9 +218,20 @@ int main(int argc, char *argv[])
 
 
 	/* Store block index in memory to avoid seek()ing a lot */
-	total_offsets  = total_blocks + 1;
-	offsets_size = total_offsets * sizeof(loff_t);
-	offsets = (loff_t *)malloc(offsets_size);
+	if (flags & CLOOP_FLAG_COMPACT_INDEX) {
+		total_offsets = (total_blocks + index_group - 1) / index_group;
+		offsets_size = total_offsets * (8 + index_group * index_length_size);
+		offsets = malloc(offsets_size);
+	} else if (flags & CLOOP_FLAG_EXTENTS) {
+		total_offsets = total_blocks;
+		offsets_size = total_offsets * sizeof(struct cloop_extent);
+		offsets = malloc(offsets_size);
+		extents = (struct cloop_extent *)offsets;
+	} else {
+		total_offsets = total_blocks + 1;
+		offsets_size = total_offsets * sizeof(uint64_t);
+		offsets = (uint64_t *)malloc(offsets_size);
+	}
 	if (offsets == NULL) {
 		perror("Out of memory");
 		fprintf(stderr, " for %d offsets.\n", total_offsets);
@@ -134,25 +243,102 @@ int main(int argc, char *argv[])
 		fprintf(stderr, " (%d bytes).\n", offsets_size);
 		exit(1);
 	}
+	if (flags & CLOOP_FLAG_COMPACT_INDEX) {
+		/* Expand the groups to extents, the blocks of a group are contiguous */
+		unsigned char *group = (unsigned char *)offsets;
+		extents = calloc(total_blocks, sizeof(struct cloop_extent));
+		if (extents == NULL) {
+			perror("Out of memory");
+			fprintf(stderr, " for %u extents.\n", total_blocks);
+			exit(1);
+		}
+		for (i = 0, pos = 0; i < total_blocks; i++) {
+			unsigned int k = i % index_group, j;
+			uint32_t length = 0;
+			if (k == 0) {
+				if (i) group += 8 + index_group * index_length_size;
+				for (pos = 0, j = 0; j < 8; j++)
+					pos |= (uint64_t)group[j] << (8 * j);
+			}
+			for (j = 0; j < index_length_size; j++)
+				length |= (uint32_t)group[8 + k * index_length_size + j] << (8 * j);
+			extents[i].offset = __be64_to_cpu(pos); /* swaps both ways */
+			extents[i].length = htonl(length);
+			pos += length;
+		}
+	}
+	pos = sizeof(head) + (head.preamble[0x0C] == '3' ? sizeof(struct cloop_head_v3) : 0) +
+	      offsets_size + ((flags & CLOOP_FLAG_CODEC_MAP) ? total_blocks : 0) +
+	      ((flags & CLOOP_FLAG_BLOCK_HASHES) ? (uint64_t)total_blocks * CLOOP_HASH_SIZE : 0);
+
+	if (flags & CLOOP_FLAG_CODEC_MAP) {
+		codec_map = malloc(total_blocks);
+		if (codec_map == NULL) {
+			perror("Out of memory");
+			fprintf(stderr, " for codec map of %u blocks.\n", total_blocks);
+			exit(1);
+		}
+		if (read(handle, codec_map, total_blocks) != total_blocks) {
+			perror("Reading codec map");
+			exit(1);
+		}
+	}
+	/* The block hashes are only used by the driver, skip them */
+	if (flags & CLOOP_FLAG_BLOCK_HASHES) {
+		uint64_t rest = (uint64_t)total_blocks * CLOOP_HASH_SIZE;
+		while (rest > 0) {
+			ssize_t r = read(handle, compressed_buffer,
+			                 rest < compressed_buffer_size ? rest : compressed_buffer_size);
+			if (r <= 0) {
+				perror("Reading block hashes");
+				exit(1);
+			}
+			rest -= r;
+		}
+	}
 	
 	for (i = 0, compressed_bytes=0, uncompressed_bytes=0, block_modulo = total_blocks / 10;
 	     i < total_blocks;
 	     i++) {
-                int size = __be64_to_cpu(offsets[i+1]) - __be64_to_cpu(offsets[i]);
+		uint64_t offset = extents ? __be64_to_cpu(extents[i].offset) : __be64_to_cpu(offsets[i]);
+		int size = extents ? (int)ntohl(extents[i].length) :
+		                     (int)(__be64_to_cpu(offsets[i+1]) - offset);
 		uLongf destlen = uncompressed_buffer_size;
 		if (size < 0 || size > compressed_buffer_size) {
 			fprintf(stderr, 
 				"%s: Size %d for block %u (offset %" PRIu64 ") wrong, corrupt data!\n",
-				argv[0], size, i, (uint64_t) __be64_to_cpu(offsets[i]));
+				argv[0], size, i, offset);
+			exit(1);
+		}
+		if (extents && size == 0) { /* all zero, not stored */
+			memset(uncompressed_buffer, 0, destlen);
+			goto write_block;
+		}
+		if (num_segments) {
+			unsigned int n = offset >> CLOOP_SEGMENT_SHIFT;
+			if (n < 1 || n > num_segments ||
+			    pread(segment[n-1], compressed_buffer, size,
+			          offset & ((1ULL << CLOOP_SEGMENT_SHIFT) - 1)) != size) {
+				fprintf(stderr, "%s: Can't read block %u (offset %" PRIx64 ") "
+				        "from its segment.\n", argv[0], i, offset);
+				exit(1);
+			}
+			goto uncompress_block;
+		}
+		/* Shared blocks point back to data read before */
+		if (offset != pos && lseek64(handle, offset, SEEK_SET) < 0) {
+			perror("Seeking to shared block, input must be a file");
 			exit(1);
 		}
 		if(read(handle, compressed_buffer, size) != size) {
 			perror("Reading block");
 			fprintf(stderr, " %u (offset %" PRIu64 ") of size %d.\n", i,
-			     (uint64_t) __be64_to_cpu(offsets[i]), size);
+			     offset, size);
 			exit(1);
 		}
+		pos = offset + size;
 
+uncompress_block:
 #if 0 /* DEBUG */
 		if (i == 3) {
 			fprintf(stderr,
@@ -177,7 +363,18 @@ int main(int argc, char *argv[])
 				buffer[3070]);
 		}
 #endif
-		switch (uncompress(uncompressed_buffer, &destlen,
+		if (codec_map)
+			compressor = codec_map[i];
+		if (compressor != CLOOP_COMPRESSOR_ZLIB) {
+			if (uncompress_other(compressor, uncompressed_buffer, &destlen,
+					     compressed_buffer, size) != 0) {
+				fprintf(stderr, "Uncomp: %s error block %u\n",
+					compressor < CLOOP_COMPRESSOR_MAX ?
+					compressor_names[compressor] : "unknown", i);
+				exit(1);
+			}
+		}
+		else switch (uncompress(uncompressed_buffer, &destlen,
 				   compressed_buffer, size)) {
 			case Z_OK: break;
 
@@ -200,13 +397,14 @@ int main(int argc, char *argv[])
 				fprintf(stderr, "Uncomp: unknown error %u\n", i);
 				exit(1);
 		}
+write_block:
 		compressed_bytes += size; uncompressed_bytes += destlen;
 		if(((i % block_modulo) == 0) || (i == (total_blocks - 1))) {
 			fprintf(stderr, "[Current block: %6u, In: %" PRIu64 "kB, Out: %" PRIu64 "kB, ratio %d%%, complete %3d%%]\n",
 			        i, 
               (uint64_t) compressed_bytes / 1024L,
               (uint64_t) uncompressed_bytes / 1024L,
-				(int)((uncompressed_bytes * 100L) / compressed_bytes),
+				compressed_bytes ? (int)((uncompressed_bytes * 100L) / compressed_bytes) : 0,
 				(int)(i * 100 / (total_blocks - 1)));
 		}
 		write(output, uncompressed_buffer, destlen);